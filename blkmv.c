@@ -15,26 +15,51 @@ You should have received a copy of the GNU General Public License
 along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <locale.h>
+#include <stdarg.h>
 
 #include <dirent.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <sys/stat.h>
 
 #if defined(__APPLE__)
 #include <sys/syslimits.h>
+#define st_mtim st_mtimespec
+#define st_ctim st_ctimespec
 #else
 #include <linux/limits.h>
 #endif
 
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <linux/io_uring.h>
+#else
+#define STATX_SIZE  0x200
+#define STATX_MTIME 0x40
+#endif
+
 #define STB_DS_IMPLEMENTATION
 #include "ext/stb_ds.h"
 
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
 static const char DEFAULT_EDITOR [] = "$EDITOR";
 
-static const char FILEPATH_PREFIX [] = "/tmp/";
+static const char FILEPATH_PREFIX [] = "/tmp";
 static const char FILEPATH_POSTFIX [] = ".blkmv";
 
 static const char HELP [] =
@@ -49,14 +74,34 @@ static const char HELP [] =
 
 static const char HELP_EXTRA [] =
 "\n"
-"--order <name/date/size/type[:name/date/size]>\n"
+"--order <none/name/date/size/type[:name/date/size]>[,...]\n"
 "    Order files by name (the default), modification date\n"
 "    (newest first), size (smallest first), or file type.\n"
 "    The type option allows another optional option\n"
 "    specified after a ':' for specifying ordering used\n"
-"    within file types (default is name).\n"
+"    within file types (default is name). Several keys can\n"
+"    be given separated by ',', e.g. date,size,name; later\n"
+"    keys order files the earlier ones consider equal.\n"
+"    none lists files in the order they are found, and\n"
+"    the editor opens without waiting for a sort.\n"
 "--reverse\n"
 "    Reverses file ordering.\n"
+"--ignore-case\n"
+"    Order names without regard to ASCII letter case.\n"
+"--collate\n"
+"    Order names by the collation of the current locale\n"
+"    (LC_COLLATE) instead of by bytes. Numbers still order\n"
+"    by value.\n"
+"--index <FILE>\n"
+"    Keep a scan index in FILE. Later runs only re-read\n"
+"    directories that changed since, and reuse the sizes and\n"
+"    dates of files in the others.\n"
+"--jobs <N>\n"
+"    Number of threads used to scan directories with -R, to\n"
+"    read file sizes or dates when io_uring is not available,\n"
+"    and to apply large edits, through io_uring or one pair\n"
+"    of directories per thread at a time. With 1 every edit is\n"
+"    applied one at a time (default is one per processor).\n"
 ;
 
 static enum {
@@ -69,308 +114,3534 @@ static enum {
 
 #define LENGTH(x) (sizeof(x)/sizeof(*(x)))
 
-typedef struct FileInfo {
-	const char * name;
-	int nslashes;
-	union {
-		size_t size;
-		time_t mod_time;
-	};
-} FileInfo;
+// one large virtual range reserved up front and committed as it fills up.
+// strings are bump allocated without per-chunk waste and referenced by
+// 32 bit offsets; everything is released with a single munmap
+#define ARENA_RESERVE (64ull << 30) // 64 GiB of address space
+#define ARENA_COMMIT  (2u << 20)    // commit in huge page sized steps
+#define ARENA_CHUNK   (1u << 20)    // handed to each scan thread at a time
+
+typedef struct Arena {
+	char * base;
+	size_t reserved;
+	size_t committed;
+	size_t used;
+	pthread_mutex_t lock;
+} Arena;
+
+// a thread's own part of an arena
+typedef struct ArenaCursor {
+	char * next;
+	char * end;
+} ArenaCursor;
+
+static Arena gArena;
+
+static int
+Arena_init(Arena * arena) {
+	memset(arena, 0, sizeof(*arena));
+	for (size_t size = ARENA_RESERVE; size >= (256u << 20); size /= 2) {
+		void * base = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (base != MAP_FAILED) {
+			arena->base = base;
+			arena->reserved = size;
+			break;
+		}
+	}
+	if (!arena->base) return -1;
+#if defined(MADV_HUGEPAGE)
+	madvise(arena->base, arena->reserved, MADV_HUGEPAGE);
+#endif
+	pthread_mutex_init(&arena->lock, NULL);
+	return 0;
+}
+
+static void
+Arena_free(Arena * arena) {
+	if (!arena->base) return;
+	munmap(arena->base, arena->reserved);
+	pthread_mutex_destroy(&arena->lock);
+	memset(arena, 0, sizeof(*arena));
+}
+
+// grows the cursor by at least size bytes, in place if nothing was
+// allocated after it. returns -1 when the reservation is used up
+static int
+Arena_refill(Arena * arena, ArenaCursor * cursor, size_t size) {
+	int result = 0;
+	pthread_mutex_lock(&arena->lock);
+	char * top = arena->base + arena->used;
+	if (cursor->end != top) {
+		cursor->next = cursor->end = top;
+	}
+	size_t want = size > ARENA_CHUNK ? size : ARENA_CHUNK;
+	if (want > arena->reserved - arena->used) {
+		want = arena->reserved - arena->used;
+	}
+	size_t new_used = arena->used + want;
+	if (new_used > arena->committed) {
+		size_t new_committed = (new_used + ARENA_COMMIT - 1) / ARENA_COMMIT * ARENA_COMMIT;
+		if (new_committed > arena->reserved) new_committed = arena->reserved;
+		if (mprotect(arena->base + arena->committed, new_committed - arena->committed, PROT_READ | PROT_WRITE) == 0) {
+			arena->committed = new_committed;
+		} else {
+			want = 0;
+		}
+	}
+	arena->used += want;
+	cursor->end += want;
+	if ((size_t)(cursor->end - cursor->next) < size) result = -1;
+	pthread_mutex_unlock(&arena->lock);
+	return result;
+}
+
+// returns NULL when the arena is full
+static inline void *
+Arena_push(Arena * arena, ArenaCursor * cursor, size_t size) {
+	if ((size_t)(cursor->end - cursor->next) < size && Arena_refill(arena, cursor, size))
+		return NULL;
+	void * result = cursor->next;
+	cursor->next += size;
+	return result;
+}
+
+// like Arena_push, aligned for any array
+static void *
+Arena_alloc(Arena * arena, ArenaCursor * cursor, size_t size) {
+	char * result = Arena_push(arena, cursor, size + 15);
+	if (!result) return NULL;
+	return (void *)(((uintptr_t)result + 15) & ~(uintptr_t)15);
+}
+
+static char *
+Arena_push_string(Arena * arena, ArenaCursor * cursor, const char * str, size_t len) {
+	char * dest = Arena_push(arena, cursor, len + 1);
+	if (dest) {
+		memcpy(dest, str, len);
+		dest[len] = '\0';
+	}
+	return dest;
+}
+
+// every listed entry is an index into these arrays. each directory path
+// is stored once and an entry is (directory, basename); strings are
+// 32 bit offsets into gArena, and sorting only moves 4 byte indices around
+#define ENTRY_NO_EXT 0xFFFF
+typedef struct EntryTable {
+	ArenaCursor cursor;      // for strings added by the main thread
+	uint32_t * dir_path;     // per directory: its path with a trailing '/', "" for "."
+	uint16_t * dir_path_len;
+	uint32_t * dir_rank;     // per directory: position in name order, see entry_rank_dirs
+	uint32_t * parent;       // per entry: its directory
+	uint32_t * name;         // per entry: its basename
+	uint16_t * depth;        // number of slashes in the full path
+	uint16_t * ext;          // offset of the last '.' in the basename, or ENTRY_NO_EXT
+	int64_t  * key;          // per entry gSortKeyWidth values: size and/or modification time
+} EntryTable;
+
+static EntryTable gEntries;
+
+static inline const char *
+arena_string(uint32_t offset) {
+	return gArena.base + offset;
+}
+
+static inline const char *
+entry_name(uint32_t entry) {
+	return arena_string(gEntries.name[entry]);
+}
+
+// builds the full path of entry in dest, which holds PATH_MAX bytes
+static const char *
+entry_path(uint32_t entry, char * dest) {
+	uint32_t dir = gEntries.parent[entry];
+	size_t dir_len = gEntries.dir_path_len[dir];
+	memcpy(dest, arena_string(gEntries.dir_path[dir]), dir_len);
+	strcpy(dest + dir_len, entry_name(entry));
+	return dest;
+}
+
+// returns the offset of str in gArena, copying it there if it lives
+// somewhere else. returns -1 if it does not fit in 32 bits
+static int64_t
+entry_string(EntryTable * entries, const char * str, size_t len) {
+	if (str < gArena.base || str >= gArena.base + gArena.reserved) {
+		str = Arena_push_string(&gArena, &entries->cursor, str, len);
+		if (!str) return -1;
+	}
+	int64_t offset = str - gArena.base;
+	return offset <= UINT32_MAX ? offset : -1;
+}
+
+// adds the directory prefix + name + '/' and returns its id.
+// returns -1 if the path gets too long or the arena runs out
+static int
+entry_add_dir(EntryTable * entries, const char * prefix, size_t prefix_len, const char * name) {
+	size_t name_len = strlen(name);
+	int slash = name_len > 0 && name[name_len-1] != '/';
+	size_t len = prefix_len + name_len + slash;
+	if (len >= PATH_MAX) return -1;
+
+	char path [PATH_MAX];
+	memcpy(path, prefix, prefix_len);
+	memcpy(path + prefix_len, name, name_len);
+	if (slash) path[len-1] = '/';
+	path[len] = '\0';
+	int64_t offset = entry_string(entries, path, len);
+	if (offset < 0) return -1;
+	arrput(entries->dir_path, offset);
+	arrput(entries->dir_path_len, len);
+	return arrlen(entries->dir_path) - 1;
+}
+
+// returns -1 if the full path gets too long or the arena runs out
+static int
+entry_add(EntryTable * entries, int dir, const char * name) {
+	size_t dir_len = entries->dir_path_len[dir];
+	size_t name_len = 0;
+	uint16_t ext = ENTRY_NO_EXT;
+	for (const char * c = name; *c != '\0'; ++c, ++name_len) {
+		if (*c == '.') ext = name_len;
+	}
+	if (dir_len + name_len >= PATH_MAX) return -1;
+	int64_t offset = entry_string(entries, name, name_len);
+	if (offset < 0) return -1;
+
+	const char * dir_path = arena_string(entries->dir_path[dir]);
+	uint16_t depth = 0;
+	for (size_t i=0; i < dir_len; ++i) {
+		if (dir_path[i] == '/') depth++;
+	}
+	arrput(entries->parent, dir);
+	arrput(entries->name, offset);
+	arrput(entries->depth, depth);
+	arrput(entries->ext, ext);
+	return 0;
+}
+
+static void
+entry_table_free(EntryTable * entries) {
+	arrfree(entries->dir_path);
+	arrfree(entries->dir_path_len);
+	arrfree(entries->dir_rank);
+	arrfree(entries->parent);
+	arrfree(entries->name);
+	arrfree(entries->depth);
+	arrfree(entries->ext);
+	arrfree(entries->key);
+}
+
+static int
+write_all(int fd, const void * data, size_t size) {
+	const char * p = data;
+	while (size > 0) {
+		ssize_t written = write(fd, p, size);
+		if (written < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		p += written, size -= written;
+	}
+	return 0;
+}
+
+// collects lines and writes them out in large blocks, without going
+// through stdio for every line
+#define LINE_WRITER_SIZE (4u << 20)
+
+typedef struct LineWriter {
+	int fd;
+	char * buffer;
+	size_t used;
+	int error;
+} LineWriter;
+
+// returns -1 if the buffer cannot be allocated
+static int
+LineWriter_init(LineWriter * writer, int fd) {
+	writer->fd = fd;
+	writer->buffer = malloc(LINE_WRITER_SIZE);
+	writer->used = 0;
+	writer->error = writer->buffer == NULL;
+	return writer->error ? -1 : 0;
+}
+
+static void
+LineWriter_flush(LineWriter * writer) {
+	if (!writer->error && write_all(writer->fd, writer->buffer, writer->used)) writer->error = 1;
+	writer->used = 0;
+}
+
+// writes dir (dir_len bytes, not terminated), name and a newline
+static inline void
+LineWriter_put(LineWriter * writer, const char * dir, size_t dir_len, const char * name) {
+	if (writer->error) return;
+	size_t name_len = strlen(name);
+	if (LINE_WRITER_SIZE - writer->used < dir_len + name_len + 1) {
+		LineWriter_flush(writer);
+		if (writer->error) return;
+	}
+	char * p = writer->buffer + writer->used;
+	memcpy(p, dir, dir_len);
+	memcpy(p + dir_len, name, name_len);
+	p[dir_len + name_len] = '\n';
+	writer->used += dir_len + name_len + 1;
+}
+
+// flushes and frees the buffer, returns -1 if anything failed to write
+static int
+LineWriter_finish(LineWriter * writer) {
+	LineWriter_flush(writer);
+	free(writer->buffer);
+	writer->buffer = NULL;
+	return writer->error ? -1 : 0;
+}
+
+static inline void
+LineWriter_put_entry(LineWriter * writer, uint32_t entry) {
+	uint32_t dir = gEntries.parent[entry];
+	LineWriter_put(writer, arena_string(gEntries.dir_path[dir]), gEntries.dir_path_len[dir], entry_name(entry));
+}
+
+typedef int (*sort_function_t)(uint32_t, uint32_t);
+typedef int (*sort_prime_t)(const void *, const void *);
+
+#define SORT_ORDER_MAX 8
+
+// the comparators below give the forward order, gSortDirection is applied
+// by the sort_prime_* functions that chain them
+static int gSortDirection = 1;
+static sort_function_t gSortOrder [SORT_ORDER_MAX]; // --order, one comparator per key
+static int gSortOrderCount;
+static sort_prime_t sort_function_prime; // set by sort_select_prime
+
+// every entry has a tuple of gSortKeyWidth values in gEntries.key,
+// holding just the stat fields that --order needs
+static int gSortKeyWidth;
+static int gSortKeySize = -1; // index of the size in the tuple
+static int gSortKeyDate = -1; // index of the modification time
+
+static inline int64_t *
+entry_key(uint32_t entry) {
+	return gEntries.key + (size_t)entry * gSortKeyWidth;
+}
+
+static inline int
+is_digit(char c) {
+	return c >= '0' && c <= '9';
+}
+
+// compares the digit runs at *a and *b by value, any number of digits
+// long, and moves both past them
+static inline int
+compare_number(const char ** a, const char ** b) {
+	while (**a == '0') (*a)++;
+	while (**b == '0') (*b)++;
+	size_t a_len = 0, b_len = 0;
+	while (is_digit((*a)[a_len])) a_len++;
+	while (is_digit((*b)[b_len])) b_len++;
+	if (a_len != b_len)
+		return a_len < b_len ? -1 : 1;
+	int diff = memcmp(*a, *b, a_len);
+	*a += a_len, *b += b_len;
+	return diff;
+}
+
+static int gFoldCase; // --ignore-case
+
+static inline char
+fold_case(char c) {
+	return (gFoldCase && c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+// compares digit runs by value and everything else as chars
+static int
+compare_natural_scalar(const char * a, const char * b) {
+	while (*a != '\0' && *b != '\0') {
+		if (is_digit(*a) && is_digit(*b)) {
+			int diff = compare_number(&a, &b);
+			if (diff)
+				return diff;
+		} else {
+			int diff = (int)fold_case(*a) - (int)fold_case(*b);
+			if (diff == 0)
+				a++, b++;
+			else
+				return diff;
+		}
+	}
+
+	return (int)fold_case(*a) - (int)fold_case(*b);
+}
+
+#if defined(__x86_64__)
+// the vector versions look at a block of bytes at a time for the first
+// one that differs, is a digit or ends a, and only go through the scalar
+// steps from there. loads never cross into the next page, so they stay
+// within mapped memory even past the end of a string
+#define CROSSES_PAGE(p, size) (((uintptr_t)(p) & 4095) > 4096 - (size))
+
+// one step of compare_natural_scalar at a stop found by the vector loop.
+// returns 1 and sets *result when the comparison is decided
+static inline int
+compare_natural_step(const char ** a, const char ** b, int * result) {
+	if (is_digit(**a) && is_digit(**b)) {
+		*result = compare_number(a, b);
+		return *result != 0;
+	}
+	*result = (int)fold_case(**a) - (int)fold_case(**b);
+	if (*result != 0 || **a == '\0') return 1;
+	(*a)++, (*b)++;
+	return 0;
+}
+
+static int
+compare_natural_sse2(const char * a, const char * b) {
+	const __m128i upper_low = _mm_set1_epi8('A' - 1), upper_high = _mm_set1_epi8('Z' + 1);
+	const __m128i digit_low = _mm_set1_epi8('0' - 1), digit_high = _mm_set1_epi8('9' + 1);
+	const __m128i case_bit = _mm_set1_epi8(gFoldCase ? 'a' - 'A' : 0);
+	const __m128i zero = _mm_setzero_si128();
+	int result;
+	for (;;) {
+		if (CROSSES_PAGE(a, 16) || CROSSES_PAGE(b, 16)) {
+			if (compare_natural_step(&a, &b, &result)) return result;
+			continue;
+		}
+		__m128i va = _mm_loadu_si128((const __m128i *)a);
+		__m128i vb = _mm_loadu_si128((const __m128i *)b);
+		// bytes above 0x7f are negative and never in range
+		va = _mm_add_epi8(va, _mm_and_si128(case_bit, _mm_and_si128(_mm_cmpgt_epi8(va, upper_low), _mm_cmpgt_epi8(upper_high, va))));
+		vb = _mm_add_epi8(vb, _mm_and_si128(case_bit, _mm_and_si128(_mm_cmpgt_epi8(vb, upper_low), _mm_cmpgt_epi8(upper_high, vb))));
+		__m128i stop = _mm_or_si128(
+			_mm_cmpeq_epi8(va, zero),
+			_mm_and_si128(_mm_cmpgt_epi8(va, digit_low), _mm_cmpgt_epi8(digit_high, va)));
+		unsigned int mask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) & 0xFFFF;
+		mask |= _mm_movemask_epi8(stop);
+		if (mask == 0) {
+			a += 16, b += 16;
+			continue;
+		}
+		int i = __builtin_ctz(mask);
+		a += i, b += i;
+		if (compare_natural_step(&a, &b, &result)) return result;
+	}
+}
+
+__attribute__((target("avx2")))
+static int
+compare_natural_avx2(const char * a, const char * b) {
+	const __m256i upper_low = _mm256_set1_epi8('A' - 1), upper_high = _mm256_set1_epi8('Z' + 1);
+	const __m256i digit_low = _mm256_set1_epi8('0' - 1), digit_high = _mm256_set1_epi8('9' + 1);
+	const __m256i case_bit = _mm256_set1_epi8(gFoldCase ? 'a' - 'A' : 0);
+	const __m256i zero = _mm256_setzero_si256();
+	int result;
+	for (;;) {
+		if (CROSSES_PAGE(a, 32) || CROSSES_PAGE(b, 32)) {
+			if (compare_natural_step(&a, &b, &result)) return result;
+			continue;
+		}
+		__m256i va = _mm256_loadu_si256((const __m256i *)a);
+		__m256i vb = _mm256_loadu_si256((const __m256i *)b);
+		va = _mm256_add_epi8(va, _mm256_and_si256(case_bit, _mm256_and_si256(_mm256_cmpgt_epi8(va, upper_low), _mm256_cmpgt_epi8(upper_high, va))));
+		vb = _mm256_add_epi8(vb, _mm256_and_si256(case_bit, _mm256_and_si256(_mm256_cmpgt_epi8(vb, upper_low), _mm256_cmpgt_epi8(upper_high, vb))));
+		__m256i stop = _mm256_or_si256(
+			_mm256_cmpeq_epi8(va, zero),
+			_mm256_and_si256(_mm256_cmpgt_epi8(va, digit_low), _mm256_cmpgt_epi8(digit_high, va)));
+		uint32_t mask = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb));
+		mask |= (uint32_t)_mm256_movemask_epi8(stop);
+		if (mask == 0) {
+			a += 32, b += 32;
+			continue;
+		}
+		int i = __builtin_ctz(mask);
+		a += i, b += i;
+		if (compare_natural_step(&a, &b, &result)) return result;
+	}
+}
+#endif
+
+// picked by compare_natural_select
+static int (*compare_natural)(const char *, const char *) = compare_natural_scalar;
+
+static void
+compare_natural_select() {
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		compare_natural = compare_natural_avx2;
+	} else {
+		// part of x86-64
+		compare_natural = compare_natural_sse2;
+	}
+#endif
+}
+
+static int gCollate; // --collate
+
+// like compare_natural, but the text between digit runs compares by the
+// locale's collation. digit runs come before text and '/' before both,
+// so paths compare one component at a time. see collate_key
+static int
+compare_collate(const char * a, const char * b) {
+	char run_a [PATH_MAX], run_b [PATH_MAX];
+	while (*a != '\0' && *b != '\0') {
+		int class_a = *a == '/' ? 0 : is_digit(*a) ? 1 : 2;
+		int class_b = *b == '/' ? 0 : is_digit(*b) ? 1 : 2;
+		if (class_a != class_b)
+			return class_a < class_b ? -1 : 1;
+		if (class_a == 0) {
+			a++, b++;
+		} else if (class_a == 1) {
+			int diff = compare_number(&a, &b);
+			if (diff)
+				return diff;
+		} else {
+			size_t a_len = strcspn(a, "/0123456789");
+			size_t b_len = strcspn(b, "/0123456789");
+			memcpy(run_a, a, a_len);
+			memcpy(run_b, b, b_len);
+			run_a[a_len] = run_b[b_len] = '\0';
+			int diff = strcoll(run_a, run_b);
+			if (diff)
+				return diff;
+			a += a_len, b += b_len;
+		}
+	}
+
+	return (*a != '\0') - (*b != '\0');
+}
+
+static inline int
+sort_function_name(uint32_t entry_a, uint32_t entry_b) {
+	uint32_t rank_a = gEntries.dir_rank[gEntries.parent[entry_a]];
+	uint32_t rank_b = gEntries.dir_rank[gEntries.parent[entry_b]];
+	if (rank_a != rank_b)
+		return rank_a < rank_b ? -1 : 1;
+
+	if (gCollate)
+		return compare_collate(entry_name(entry_a), entry_name(entry_b));
+	return compare_natural(entry_name(entry_a), entry_name(entry_b));
+}
+
+// entries without an extension come first, extensions compare as a whole
+static inline int
+compare_ext(uint32_t entry_a, uint32_t entry_b) {
+	uint16_t ext_a = gEntries.ext[entry_a];
+	uint16_t ext_b = gEntries.ext[entry_b];
+	if (ext_a == ENTRY_NO_EXT || ext_b == ENTRY_NO_EXT) {
+		if (ext_a != ext_b)
+			return ext_a == ENTRY_NO_EXT ? -1 : 1;
+		return 0;
+	}
+	const char * a = entry_name(entry_a) + ext_a;
+	const char * b = entry_name(entry_b) + ext_b;
+	while (*a == *b && *a != '\0')
+		a++, b++;
+	return (int)*a - (int)*b;
+}
+
+static int
+sort_function_type(uint32_t entry_a, uint32_t entry_b) {
+	return compare_ext(entry_a, entry_b);
+}
+
+// larger first
+static inline int
+compare_key(int64_t a, int64_t b) {
+	return a < b ? 1 : -(a > b);
+}
+
+static int
+sort_function_size(uint32_t entry_a, uint32_t entry_b) {
+	return compare_key(entry_key(entry_a)[gSortKeySize], entry_key(entry_b)[gSortKeySize]);
+}
+
+// newer first
+static int
+sort_function_mod(uint32_t entry_a, uint32_t entry_b) {
+	return compare_key(entry_key(entry_a)[gSortKeyDate], entry_key(entry_b)[gSortKeyDate]);
+}
+
+// for the generated comparators, when the tuple holds a single value
+static inline int
+sort_function_key(uint32_t entry_a, uint32_t entry_b) {
+	return compare_key(gEntries.key[entry_a], gEntries.key[entry_b]);
+}
+
+// any --order, one key after the other
+static int
+sort_function_order(uint32_t entry_a, uint32_t entry_b) {
+	for (int k=0; k < gSortOrderCount; ++k) {
+		int diff = gSortOrder[k](entry_a, entry_b);
+		if (diff) return diff;
+	}
+	return 0;
+}
+
+// deeper entries first, then first and second. with constant arguments
+// everything is inlined into the qsort comparators generated below
+static inline __attribute__((always_inline)) int
+sort_prime_chain(const void * voida, const void * voidb, sort_function_t first, sort_function_t second, int direction) {
+	uint32_t entry_a = *(const uint32_t *)voida;
+	uint32_t entry_b = *(const uint32_t *)voidb;
+
+	int slash_diff = (int)gEntries.depth[entry_b] - (int)gEntries.depth[entry_a];
+	if (slash_diff) return slash_diff;
+
+	int diff = first(entry_a, entry_b);
+	if (diff == 0 && second) diff = second(entry_a, entry_b);
+	if (diff) return diff * direction;
+	// same order as the keyed sort, which is stable
+	return entry_a < entry_b ? -1 : entry_a > entry_b;
+}
+
+#define SORT_PRIME(suffix, first, second) \
+	static int \
+	sort_prime_##suffix(const void * a, const void * b) { \
+		return sort_prime_chain(a, b, first, second, 1); \
+	} \
+	static int \
+	sort_prime_##suffix##_reverse(const void * a, const void * b) { \
+		return sort_prime_chain(a, b, first, second, -1); \
+	}
+
+// size and date are the only value in the tuple in the key ones
+SORT_PRIME(name, sort_function_name, NULL)
+SORT_PRIME(key, sort_function_key, NULL)
+SORT_PRIME(type_name, compare_ext, sort_function_name)
+SORT_PRIME(type_key, compare_ext, sort_function_key)
+SORT_PRIME(order, sort_function_order, NULL)
+
+// picks the comparator for the parsed --order and --reverse
+static void
+sort_select_prime() {
+	static const sort_prime_t primes [2][2][2] = {
+		{ { sort_prime_name, sort_prime_name_reverse },
+		  { sort_prime_key, sort_prime_key_reverse } },
+		{ { sort_prime_type_name, sort_prime_type_name_reverse },
+		  { sort_prime_type_key, sort_prime_type_key_reverse } },
+	};
+	int reverse = gSortDirection < 0;
+	if (gSortOrderCount == 0) return;
+	int type = gSortOrder[0] == sort_function_type;
+	if (gSortOrderCount == 1 + type) {
+		sort_function_t last = gSortOrder[type];
+		if (last == sort_function_name) {
+			sort_function_prime = primes[type][0][reverse];
+			return;
+		} else if (last == sort_function_size || last == sort_function_mod) {
+			sort_function_prime = primes[type][1][reverse];
+			return;
+		}
+	}
+	sort_function_prime = reverse ? sort_prime_order_reverse : sort_prime_order;
+}
+
+// runs fn(data) on count threads, the calling thread included,
+// and waits for all of them to return
+static void
+run_threads(void * (*fn)(void *), void * data, int count) {
+	pthread_t * threads = malloc(count * sizeof(*threads));
+	int started = 1;
+	while (started < count) {
+		if (pthread_create(&threads[started], NULL, fn, data))
+			break;
+		started++;
+	}
+	fn(data);
+	for (int i=1; i < started; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+	free(threads);
+}
+
+static int gJobs = 0; // 0 means one per online processor
+
+static int
+job_count() {
+	int count = gJobs;
+	if (count <= 0) count = sysconf(_SC_NPROCESSORS_ONLN);
+	if (count <= 0) count = 1;
+	return count;
+}
+
+// byte strings that memcmp orders like the comparators above. they are
+// built once per entry, so big listings are sorted without reparsing
+// names or calling through the comparators
+#define SORT_KEY_THRESHOLD 1024 // below this qsort with the comparators wins
+#define SORT_KEY_MAX (4 * PATH_MAX + 32)
+#define COLLATE_KEY_MAX 2048 // per name, so SORT_ORDER_MAX of them fit in SORT_KEY_MAX
+#define RADIX_CUTOFF 32
+#define SORT_PARALLEL_THRESHOLD 200000 // below this one thread is faster
+#define SORT_JOB_CHUNK 4096
+#define SORT_DIR_MIN 32 // average entries per directory to sort them one by one
+
+typedef struct SortKeys {
+	const uint8_t ** key;
+	uint16_t * length;
+} SortKeys;
+
+// bytes are flipped so they order like signed chars, with the terminator
+// in between as in compare_natural. a digit run becomes '0', its length
+// without leading zeros and those digits; no other byte maps to '0'..'9',
+// so a run still compares against anything else like its first digit did
+static size_t
+natural_key(uint8_t * dest, const char * str) {
+	uint8_t * p = dest;
+	while (*str != '\0') {
+		if (is_digit(*str)) {
+			while (*str == '0') str++;
+			size_t len = 0;
+			while (is_digit(str[len])) len++;
+			*p++ = '0' ^ 0x80;
+			*p++ = len >> 8;
+			*p++ = len;
+			memcpy(p, str, len);
+			p += len, str += len;
+		} else {
+			*p++ = fold_case(*str++) ^ 0x80;
+		}
+	}
+	*p++ = 0x80;
+	return p - dest;
+}
+
+// encodes str so memcmp orders like compare_collate: a digit run becomes
+// 1, its length and digits as in natural_key, other text 2, its strxfrm
+// and 0, and '/' and the end 0. keys longer than size are cut off
+static size_t
+collate_key(uint8_t * dest, size_t size, const char * str) {
+	char run [PATH_MAX];
+	uint8_t * p = dest;
+	uint8_t * end = dest + size;
+	while (*str != '\0') {
+		if (*str == '/') {
+			if (p == end) return size;
+			*p++ = 0;
+			str++;
+		} else if (is_digit(*str)) {
+			while (*str == '0') str++;
+			size_t len = 0;
+			while (is_digit(str[len])) len++;
+			if ((size_t)(end - p) < len + 3) return p - dest;
+			*p++ = 1;
+			*p++ = len >> 8;
+			*p++ = len;
+			memcpy(p, str, len);
+			p += len, str += len;
+		} else {
+			size_t len = strcspn(str, "/0123456789");
+			memcpy(run, str, len);
+			run[len] = '\0';
+			str += len;
+			if ((size_t)(end - p) < 3) return p - dest;
+			*p++ = 2;
+			size_t room = end - p - 1;
+			size_t xfrm_len = strxfrm((char *)p, run, room);
+			if (xfrm_len >= room) {
+				// does not fit, the contents are undefined
+				char * full = malloc(xfrm_len + 1);
+				strxfrm(full, run, xfrm_len + 1);
+				memcpy(p, full, room);
+				free(full);
+				return size - 1;
+			}
+			p += xfrm_len;
+			*p++ = 0;
+		}
+	}
+	if (p == end) return size;
+	*p++ = 0;
+	return p - dest;
+}
+
+// the keys of --order one after the other. every part is either fixed
+// size or ends in a terminator, so no key is a prefix of another. the
+// exception is a collate key cut off at COLLATE_KEY_MAX: names that long
+// are only ordered by the part of their key that fits
+static size_t
+sort_key_child(uint8_t * dest, uint32_t entry) {
+	uint8_t * p = dest;
+	for (int k=0; k < gSortOrderCount; ++k) {
+		sort_function_t fn = gSortOrder[k];
+		if (fn == sort_function_type) {
+			uint16_t ext = gEntries.ext[entry];
+			if (ext == ENTRY_NO_EXT) {
+				*p++ = 0;
+			} else {
+				for (const char * c = entry_name(entry) + ext; *c != '\0'; ++c) {
+					*p++ = *c ^ 0x80;
+				}
+				*p++ = 0x80;
+			}
+		} else if (fn == sort_function_name) {
+			uint32_t rank = gEntries.dir_rank[gEntries.parent[entry]];
+			for (int i=3; i >= 0; --i) *p++ = rank >> (i * 8);
+			if (gCollate) {
+				p += collate_key(p, COLLATE_KEY_MAX, entry_name(entry));
+			} else {
+				p += natural_key(p, entry_name(entry));
+			}
+		} else {
+			// larger first
+			int64_t value = entry_key(entry)[fn == sort_function_size ? gSortKeySize : gSortKeyDate];
+			uint64_t key = ~((uint64_t)value ^ (1ull << 63));
+			for (int i=7; i >= 0; --i) *p++ = key >> (i * 8);
+		}
+	}
+	return p - dest;
+}
+
+static inline int
+sort_key_byte(const SortKeys * keys, uint32_t i, size_t pos) {
+	return pos < keys->length[i] ? keys->key[i][pos] + 1 : 0;
+}
+
+static inline int
+sort_key_compare(const SortKeys * keys, uint32_t a, uint32_t b, size_t pos) {
+	size_t len_a = keys->length[a], len_b = keys->length[b];
+	size_t len = len_a < len_b ? len_a : len_b;
+	int diff = len > pos ? memcmp(keys->key[a] + pos, keys->key[b] + pos, len - pos) : 0;
+	if (diff) return diff;
+	return len_a < len_b ? -1 : len_a > len_b;
+}
+
+// distributes list into buckets by the first byte at or after *pos where
+// the keys differ, and sets *pos to it. list has to be longer than
+// RADIX_CUTOFF. returns -1 if all keys are equal
+static int
+radix_distribute(const SortKeys * keys, uint32_t * list, uint32_t * tmp, size_t count, size_t * pos, uint32_t * counts) {
+	for (;;) {
+		memset(counts, 0, 257 * sizeof(*counts));
+		for (size_t i=0; i < count; ++i) {
+			counts[sort_key_byte(keys, list[i], *pos)]++;
+		}
+		// every key has ended
+		if (counts[0] == count) return -1;
+		// skip bytes all keys have in common without moving anything
+		if (counts[sort_key_byte(keys, list[0], *pos)] != count) break;
+		(*pos)++;
+	}
+
+	size_t start [257];
+	size_t sum = 0;
+	for (int b=0; b < 257; ++b) {
+		start[b] = sum;
+		sum += counts[b];
+	}
+	for (size_t i=0; i < count; ++i) {
+		tmp[start[sort_key_byte(keys, list[i], *pos)]++] = list[i];
+	}
+	memcpy(list, tmp, count * sizeof(*list));
+	return 0;
+}
+
+// stable msd radix sort of list by keys, all of which agree on the
+// first pos bytes. tmp holds count elements
+static void
+radix_sort(const SortKeys * keys, uint32_t * list, uint32_t * tmp, size_t count, size_t pos) {
+	if (count < RADIX_CUTOFF) {
+		for (size_t i=1; i < count; ++i) {
+			uint32_t item = list[i];
+			size_t j = i;
+			for (; j > 0 && sort_key_compare(keys, list[j-1], item, pos) > 0; --j) {
+				list[j] = list[j-1];
+			}
+			list[j] = item;
+		}
+		return;
+	}
+
+	uint32_t counts [257];
+	if (radix_distribute(keys, list, tmp, count, &pos, counts)) return;
+	// bucket 0 holds keys that ended, they need no sorting
+	size_t begin = counts[0];
+	for (int b=1; b < 257; ++b) {
+		if (counts[b] > 1) radix_sort(keys, list + begin, tmp + begin, counts[b], pos + 1);
+		begin += counts[b];
+	}
+}
+
+// ranks directories by compare_natural on their paths, so comparing two
+// full paths only has to look at the basenames when the ranks are equal.
+// every directory path ends in '/', so at the same depth the paths differ
+// before either ends or compare equal as a whole
+static void
+entry_rank_dirs(EntryTable * entries) {
+	int count = arrlen(entries->dir_path);
+	SortKeys keys;
+	keys.key = malloc(count * sizeof(*keys.key));
+	keys.length = malloc(count * sizeof(*keys.length));
+	uint32_t * order = malloc(count * sizeof(*order));
+	uint32_t * tmp = malloc(count * sizeof(*tmp));
+	uint8_t * buffer = malloc(SORT_KEY_MAX);
+	for (int i=0; i < count; ++i) {
+		const char * path = arena_string(entries->dir_path[i]);
+		size_t len = gCollate ? collate_key(buffer, SORT_KEY_MAX, path) : natural_key(buffer, path);
+		uint8_t * key = Arena_push(&gArena, &entries->cursor, len);
+		if (key) memcpy(key, buffer, len);
+		// out of memory, every path that did not fit ranks as ""
+		keys.key[i] = key;
+		keys.length[i] = key ? len : 0;
+		order[i] = i;
+	}
+	radix_sort(&keys, order, tmp, count, 0);
+
+	arrsetlen(entries->dir_rank, count);
+	uint32_t rank = 0;
+	for (int i=0; i < count; ++i) {
+		if (i > 0 && sort_key_compare(&keys, order[i-1], order[i], 0) != 0) rank++;
+		entries->dir_rank[order[i]] = rank;
+	}
+	free(buffer);
+	free(tmp);
+	free(order);
+	free(keys.length);
+	free(keys.key);
+}
+
+typedef struct SortTask {
+	size_t begin;
+	size_t count;
+	size_t pos;
+} SortTask;
+
+typedef struct SortJob {
+	SortKeys keys;
+	uint32_t * list;
+	uint32_t * tmp;
+	size_t count;
+	SortTask * tasks;
+	size_t next; // next chunk of list or next task, taken atomically
+	int error;
+} SortJob;
+
+static void *
+sort_key_worker(void * data) {
+	SortJob * job = data;
+	ArenaCursor cursor = { NULL, NULL };
+	uint8_t buffer [SORT_KEY_MAX];
+	for (;;) {
+		size_t start = __atomic_fetch_add(&job->next, SORT_JOB_CHUNK, __ATOMIC_RELAXED);
+		if (start >= job->count) break;
+		size_t end = start + SORT_JOB_CHUNK;
+		if (end > job->count) end = job->count;
+		for (size_t i=start; i < end; ++i) {
+			uint32_t entry = job->list[i];
+			// deeper entries first
+			uint16_t depth = ~gEntries.depth[entry];
+			buffer[0] = depth >> 8;
+			buffer[1] = depth;
+			size_t len = 2 + sort_key_child(buffer + 2, entry);
+			if (gSortDirection < 0) {
+				for (size_t j=2; j < len; ++j) buffer[j] = ~buffer[j];
+			}
+			uint8_t * key = Arena_push(&gArena, &cursor, len);
+			if (!key) {
+				job->error = 1;
+				return NULL;
+			}
+			memcpy(key, buffer, len);
+			job->keys.key[entry] = key;
+			job->keys.length[entry] = len;
+		}
+	}
+	return NULL;
+}
+
+// radix sorts the list like radix_sort, but leaves buckets of up to
+// limit entries as tasks to be sorted by sort_task_worker
+static void
+radix_split(SortJob * job, size_t begin, size_t count, size_t pos, size_t limit) {
+	if (count <= limit) {
+		SortTask task = { begin, count, pos };
+		arrput(job->tasks, task);
+		return;
+	}
+
+	uint32_t counts [257];
+	if (radix_distribute(&job->keys, job->list + begin, job->tmp + begin, count, &pos, counts)) return;
+	begin += counts[0];
+	for (int b=1; b < 257; ++b) {
+		if (counts[b] > 1) radix_split(job, begin, counts[b], pos + 1, limit);
+		begin += counts[b];
+	}
+}
+
+static void *
+sort_task_worker(void * data) {
+	SortJob * job = data;
+	for (;;) {
+		size_t i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+		if (i >= (size_t)arrlen(job->tasks)) break;
+		SortTask * task = &job->tasks[i];
+		radix_sort(&job->keys, job->list + task->begin, job->tmp + task->begin, task->count, task->pos);
+	}
+	return NULL;
+}
+
+static int
+compare_task_size(const void * a, const void * b) {
+	size_t count_a = ((const SortTask *)a)->count;
+	size_t count_b = ((const SortTask *)b)->count;
+	return count_a < count_b ? 1 : -(count_a > count_b);
+}
+
+static const uint32_t * gSortRunList; // for compare_task_depth
+
+// head of a sorted run in sort_merge
+typedef struct SortRun {
+	size_t next;
+	size_t end;
+} SortRun;
+
+static inline int
+sort_run_less(const SortJob * job, const SortRun * a, const SortRun * b) {
+	uint32_t entry_a = job->list[a->next];
+	uint32_t entry_b = job->list[b->next];
+	int diff = sort_key_compare(&job->keys, entry_a, entry_b, 0);
+	// the global sort is stable
+	return diff ? diff < 0 : entry_a < entry_b;
+}
+
+static void
+sort_heap_down(const SortJob * job, SortRun * heap, size_t count, size_t i) {
+	for (;;) {
+		size_t least = i;
+		size_t left = 2*i + 1, right = 2*i + 2;
+		if (left < count && sort_run_less(job, &heap[left], &heap[least])) least = left;
+		if (right < count && sort_run_less(job, &heap[right], &heap[least])) least = right;
+		if (least == i) return;
+		SortRun swap = heap[i];
+		heap[i] = heap[least];
+		heap[least] = swap;
+		i = least;
+	}
+}
+
+// merges the sorted runs tasks[0..count) of job->list into out
+static void
+sort_merge(const SortJob * job, const SortTask * tasks, size_t count, uint32_t * out) {
+	SortRun * heap = malloc(count * sizeof(*heap));
+	for (size_t i=0; i < count; ++i) {
+		heap[i].next = tasks[i].begin;
+		heap[i].end = tasks[i].begin + tasks[i].count;
+	}
+	for (size_t i=count/2; i-- > 0;) {
+		sort_heap_down(job, heap, count, i);
+	}
+	while (count > 0) {
+		SortRun * top = &heap[0];
+		SortRun * second = NULL;
+		if (count > 1) second = &heap[1];
+		if (count > 2 && sort_run_less(job, &heap[2], second)) second = &heap[2];
+		if (!second) {
+			// last run left
+			memcpy(out, job->list + top->next, (top->end - top->next) * sizeof(*out));
+			break;
+		}
+		// directories at the same depth rarely overlap in name order, so
+		// try to take the whole run before going one entry at a time
+		SortRun last = { top->end - 1, top->end };
+		if (sort_run_less(job, &last, second)) {
+			size_t n = top->end - top->next;
+			memcpy(out, job->list + top->next, n * sizeof(*out));
+			out += n;
+			top->next = top->end;
+		} else {
+			do {
+				*out++ = job->list[top->next++];
+			} while (top->next < top->end && sort_run_less(job, top, second));
+		}
+		if (top->next == top->end) heap[0] = heap[--count];
+		sort_heap_down(job, heap, count, 0);
+	}
+	free(heap);
+}
+
+static int
+compare_task_depth(const void * a, const void * b) {
+	const SortTask * task_a = a;
+	const SortTask * task_b = b;
+	int depth_a = gEntries.depth[gSortRunList[task_a->begin]];
+	int depth_b = gEntries.depth[gSortRunList[task_b->begin]];
+	if (depth_a != depth_b) return depth_b - depth_a;
+	return task_a->begin < task_b->begin ? -1 : task_a->begin > task_b->begin;
+}
+
+// sorts the entries of each directory on their own and merges the runs
+// of each depth. the runs are small enough to be sorted in cache, and
+// all entries of a directory have the same depth
+static void
+sort_by_directory(SortJob * job, int threads) {
+	// the depth and in name order the directory rank are the same for
+	// every entry of a directory
+	size_t pos = gSortOrder[0] == sort_function_name ? 6 : 2;
+	size_t dir_count = arrlen(gEntries.dir_path);
+	size_t * start = calloc(dir_count + 1, sizeof(*start));
+	for (size_t i=0; i < job->count; ++i) {
+		start[gEntries.parent[job->list[i]] + 1]++;
+	}
+	for (size_t d=0; d < dir_count; ++d) {
+		if (start[d+1] > 0) {
+			SortTask task = { start[d], start[d+1], pos };
+			arrput(job->tasks, task);
+		}
+		start[d+1] += start[d];
+	}
+	// group by directory, keeping the list order within each
+	for (size_t i=0; i < job->count; ++i) {
+		job->tmp[start[gEntries.parent[job->list[i]]]++] = job->list[i];
+	}
+	memcpy(job->list, job->tmp, job->count * sizeof(*job->list));
+	free(start);
+
+	job->next = 0;
+	qsort(job->tasks, arrlen(job->tasks), sizeof(*job->tasks), compare_task_size);
+	run_threads(sort_task_worker, job, threads);
+
+	gSortRunList = job->list;
+	qsort(job->tasks, arrlen(job->tasks), sizeof(*job->tasks), compare_task_depth);
+	uint32_t * out = job->tmp;
+	for (size_t first=0, last; first < (size_t)arrlen(job->tasks); first = last) {
+		uint16_t depth = gEntries.depth[job->list[job->tasks[first].begin]];
+		size_t entries = 0;
+		for (last=first; last < (size_t)arrlen(job->tasks); ++last) {
+			if (gEntries.depth[job->list[job->tasks[last].begin]] != depth) break;
+			entries += job->tasks[last].count;
+		}
+		sort_merge(job, job->tasks + first, last - first, out);
+		out += entries;
+	}
+	memcpy(job->list, job->tmp, job->count * sizeof(*job->list));
+	arrfree(job->tasks);
+}
+
+// sorts list like qsort with sort_function_prime. big lists are sorted on
+// job_count() threads; radix_split does the same steps as radix_sort, so
+// the result does not depend on the number of threads
+static void
+sort_entries(uint32_t * list, size_t count) {
+	// collating in the comparators is much slower than building the keys
+	if (count < SORT_KEY_THRESHOLD && !gCollate) {
+		qsort(list, count, sizeof(*list), sort_function_prime);
+		return;
+	}
+	int threads = count < SORT_PARALLEL_THRESHOLD ? 1 : job_count();
+
+	// indexed by entry
+	size_t total = arrlen(gEntries.name);
+	SortJob job;
+	memset(&job, 0, sizeof(job));
+	job.keys.key = malloc(total * sizeof(*job.keys.key));
+	job.keys.length = malloc(total * sizeof(*job.keys.length));
+	job.list = list;
+	job.count = count;
+	run_threads(sort_key_worker, &job, threads);
+	if (job.error) {
+		free(job.keys.length);
+		free(job.keys.key);
+		qsort(list, count, sizeof(*list), sort_function_prime);
+		return;
+	}
+
+	job.tmp = malloc(count * sizeof(*job.tmp));
+	// in name order the directories of a depth do not overlap and merging
+	// them is mostly copying. in other orders they interleave and the
+	// merge costs more than sorting everything at once
+	size_t dir_count = arrlen(gEntries.dir_path);
+	if (gSortOrder[0] == sort_function_name && count / dir_count >= SORT_DIR_MIN) {
+		sort_by_directory(&job, threads);
+	} else if (threads == 1) {
+		radix_sort(&job.keys, list, job.tmp, count, 0);
+	} else {
+		size_t limit = count / (threads * 8);
+		if (limit < RADIX_CUTOFF) limit = RADIX_CUTOFF;
+		radix_split(&job, 0, count, 0, limit);
+		// biggest first, so no thread is left with a big one at the end
+		qsort(job.tasks, arrlen(job.tasks), sizeof(*job.tasks), compare_task_size);
+		job.next = 0;
+		run_threads(sort_task_worker, &job, threads);
+		arrfree(job.tasks);
+	}
+	free(job.tmp);
+	free(job.keys.length);
+	free(job.keys.key);
+}
+
+
+
+#if defined(__linux__)
+// minimal io_uring setup on top of the raw syscalls
+typedef struct Uring {
+	int fd;
+	unsigned entries;
+	unsigned * sq_head, * sq_tail, * sq_mask, * sq_array;
+	unsigned * cq_head, * cq_tail, * cq_mask;
+	struct io_uring_sqe * sqes;
+	struct io_uring_cqe * cqes;
+	unsigned sq_local_tail; // sqes handed out but not yet submitted end here
+	void * sq_ptr, * cq_ptr;
+	size_t sq_size, cq_size;
+} Uring;
+
+static int
+Uring_init(Uring * ring, unsigned entries) {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	memset(ring, 0, sizeof(*ring));
+	ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (ring->fd < 0) return -1;
+
+	ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_size > ring->sq_size) ring->sq_size = ring->cq_size;
+		ring->cq_size = 0;
+	}
+	ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	                    ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ptr == MAP_FAILED) goto fail;
+	if (ring->cq_size) {
+		ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		                    ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ptr == MAP_FAILED) goto fail;
+	} else {
+		ring->cq_ptr = ring->sq_ptr;
+	}
+	ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+	                  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) goto fail;
+
+	char * sq = ring->sq_ptr, * cq = ring->cq_ptr;
+	ring->sq_head  = (unsigned *)(sq + params.sq_off.head);
+	ring->sq_tail  = (unsigned *)(sq + params.sq_off.tail);
+	ring->sq_mask  = (unsigned *)(sq + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+	ring->cq_head  = (unsigned *)(cq + params.cq_off.head);
+	ring->cq_tail  = (unsigned *)(cq + params.cq_off.tail);
+	ring->cq_mask  = (unsigned *)(cq + params.cq_off.ring_mask);
+	ring->cqes     = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+	ring->entries = params.sq_entries;
+	ring->sq_local_tail = *ring->sq_tail;
+	return 0;
+
+fail:
+	if (ring->sq_ptr && ring->sq_ptr != MAP_FAILED) munmap(ring->sq_ptr, ring->sq_size);
+	if (ring->cq_size && ring->cq_ptr && ring->cq_ptr != MAP_FAILED) munmap(ring->cq_ptr, ring->cq_size);
+	close(ring->fd);
+	return -1;
+}
+
+static void
+Uring_destroy(Uring * ring) {
+	munmap(ring->sqes, ring->entries * sizeof(struct io_uring_sqe));
+	if (ring->cq_size) munmap(ring->cq_ptr, ring->cq_size);
+	munmap(ring->sq_ptr, ring->sq_size);
+	close(ring->fd);
+}
+
+static int
+Uring_supports(Uring * ring, int opcode) {
+	size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe * probe = calloc(1, size);
+	int result = 0;
+	if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256) == 0) {
+		result = opcode <= probe->last_op && (probe->ops[opcode].flags & IO_URING_OP_SUPPORTED);
+	}
+	free(probe);
+	return result;
+}
+
+// returns a zeroed sqe, or NULL if the submission queue is full
+static struct io_uring_sqe *
+Uring_sqe(Uring * ring) {
+	unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	if (ring->sq_local_tail - head >= ring->entries) return NULL;
+	unsigned index = ring->sq_local_tail & *ring->sq_mask;
+	ring->sq_array[index] = index;
+	ring->sq_local_tail++;
+	memset(&ring->sqes[index], 0, sizeof(ring->sqes[index]));
+	return &ring->sqes[index];
+}
+
+// submits every sqe handed out so far and waits for wait_nr completions
+static int
+Uring_submit(Uring * ring, unsigned wait_nr) {
+	unsigned to_submit = ring->sq_local_tail - *ring->sq_tail;
+	__atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+	for (;;) {
+		long result = syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_nr,
+		                      wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+		if (result >= 0 || errno != EINTR) return result < 0 ? -1 : 0;
+		to_submit = 0;
+	}
+}
+
+static struct io_uring_cqe *
+Uring_cqe(Uring * ring) {
+	unsigned head = *ring->cq_head;
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+	return &ring->cqes[head & *ring->cq_mask];
+}
+
+static void
+Uring_cqe_seen(Uring * ring) {
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+typedef struct StatxBatch {
+	int dir_fd;
+	int flags;
+	unsigned int mask;
+	int count;
+	const char * (*name)(void * data, int index, char * scratch); // scratch holds PATH_MAX bytes
+	void (*done)(void * data, int index, const struct statx * stx); // stx is zeroed on failure
+	void * data;
+} StatxBatch;
+
+// keeps the ring full of statx requests until every entry is done.
+// returns -1 if the ring itself failed; entries may then be half done
+static int
+Uring_statx(Uring * ring, const StatxBatch * batch) {
+	// one statx buffer per request in flight
+	struct statx * results = malloc(ring->entries * sizeof(*results));
+	int * free_slots = malloc(ring->entries * sizeof(*free_slots));
+	int * slot_entry = malloc(ring->entries * sizeof(*slot_entry));
+	char * scratch = malloc((size_t)ring->entries * PATH_MAX);
+	int free_count = ring->entries;
+	for (int i=0; i < free_count; ++i) free_slots[i] = i;
+
+	int next = 0, in_flight = 0, error = 0;
+	while (next < batch->count || in_flight > 0) {
+		while (next < batch->count && free_count > 0) {
+			struct io_uring_sqe * sqe = Uring_sqe(ring);
+			if (!sqe) break;
+			int slot = free_slots[--free_count];
+			slot_entry[slot] = next;
+			sqe->opcode = IORING_OP_STATX;
+			sqe->fd = batch->dir_fd;
+			sqe->addr = (unsigned long)batch->name(batch->data, next, scratch + (size_t)slot * PATH_MAX);
+			sqe->len = batch->mask;
+			sqe->off = (unsigned long)&results[slot];
+			sqe->statx_flags = batch->flags;
+			sqe->user_data = slot;
+			next++, in_flight++;
+		}
+		if (Uring_submit(ring, 1)) {
+			error = 1;
+			break;
+		}
+
+		struct io_uring_cqe * cqe;
+		while ((cqe = Uring_cqe(ring)) != NULL) {
+			int slot = cqe->user_data;
+			if (cqe->res < 0) memset(&results[slot], 0, sizeof(results[slot]));
+			batch->done(batch->data, slot_entry[slot], &results[slot]);
+			free_slots[free_count++] = slot;
+			in_flight--;
+			Uring_cqe_seen(ring);
+		}
+	}
+
+	// requests still in flight after a failed submit may complete later
+	// and write into results or read their names from scratch, so
+	// those stay allocated
+	if (in_flight == 0) {
+		free(scratch);
+		free(results);
+	}
+	free(slot_entry);
+	free(free_slots);
+	return error ? -1 : 0;
+}
+#endif
+
+#define DIR_BUFFER_SIZE 1048576 // 1 MiB
+
+// reads directory entries straight into a caller supplied buffer
+// with getdents64 so huge directories only take a handful of syscalls.
+// "." and ".." are never returned. the caller keeps ownership of dir_fd.
+typedef struct DirReader {
+#if defined(__linux__)
+	int fd;
+	char * buffer;
+	size_t capacity;
+	long length;
+	long offset;
+#else
+	DIR * dir;
+#endif
+} DirReader;
+
+#if defined(__linux__)
+struct linux_dirent64 {
+	unsigned long long d_ino;
+	long long          d_off;
+	unsigned short     d_reclen;
+	unsigned char      d_type;
+	char               d_name [];
+};
+#endif
+
+static int
+DirReader_open(DirReader * reader, int dir_fd, char * buffer, size_t capacity) {
+#if defined(__linux__)
+	reader->fd = dir_fd;
+	reader->buffer = buffer;
+	reader->capacity = capacity;
+	reader->length = 0;
+	reader->offset = 0;
+	return 0;
+#else
+	(void)buffer, (void)capacity;
+	int fd = dup(dir_fd);
+	reader->dir = fd < 0 ? NULL : fdopendir(fd);
+	if (!reader->dir && fd >= 0) close(fd);
+	return reader->dir ? 0 : -1;
+#endif
+}
+
+static const char *
+DirReader_next(DirReader * reader, unsigned char * d_type) {
+	for (;;) {
+		const char * name;
+#if defined(__linux__)
+		if (reader->offset >= reader->length) {
+			reader->length = syscall(SYS_getdents64, reader->fd, reader->buffer, reader->capacity);
+			reader->offset = 0;
+			if (reader->length <= 0) return NULL;
+		}
+		struct linux_dirent64 * entry = (struct linux_dirent64 *)(reader->buffer + reader->offset);
+		reader->offset += entry->d_reclen;
+		name = entry->d_name;
+		*d_type = entry->d_type;
+#else
+		struct dirent * entry = readdir(reader->dir);
+		if (entry == NULL) return NULL;
+		name = entry->d_name;
+		*d_type = entry->d_type;
+#endif
+		if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+			continue;
+		return name;
+	}
+}
+
+static void
+DirReader_close(DirReader * reader) {
+#if defined(__linux__)
+	(void)reader;
+#else
+	closedir(reader->dir);
+#endif
+}
+
+// the scan index (--index) remembers what every directory contained the
+// last time it was scanned. a directory whose mtime and ctime have not
+// changed since then is not read again; its entries, and the sizes and
+// dates stat'ed for them, are taken from the index.
+// layout: IndexHeader, IndexDir [dir_count], IndexFile [file_count], strings
+#define INDEX_MAGIC "blkmvix1"
+#define INDEX_HAS_SIZE  0x1
+#define INDEX_HAS_MTIME 0x2
+
+typedef struct IndexHeader {
+	char magic [8];
+	uint32_t flags;      // the arg_mask bits that change what gets listed
+	uint32_t dir_count;
+	uint32_t file_count;
+	uint32_t pad;
+	uint64_t strings_size;
+} IndexHeader;
+
+typedef struct IndexDir {
+	uint64_t dev;
+	uint64_t ino;
+	int64_t  mtime_sec;
+	int64_t  ctime_sec;
+	uint32_t mtime_nsec;
+	uint32_t ctime_nsec;
+	uint32_t name;        // offset into strings
+	uint32_t first_file;
+	uint32_t file_count;
+	uint32_t first_child; // children are consecutive dirs, sorted by name
+	uint32_t child_count;
+	uint32_t pad;
+} IndexDir;
+
+typedef struct IndexFile {
+	uint32_t name;
+	uint32_t flags;
+	uint64_t size;
+	int64_t  mtime;
+} IndexFile;
+
+#define INDEX_ARG_MASK (ARG_HIDDEN | ARG_RECUR | ARG_DMODE)
+
+static const char * gIndexPath = NULL;
+
+static struct {
+	const IndexHeader * header; // NULL if there is no usable index
+	const IndexDir * dirs;
+	const IndexFile * files;
+	const char * strings;
+	size_t size;
+} gIndex;
+
+static void
+index_load(const char * path) {
+	memset(&gIndex, 0, sizeof(gIndex));
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return;
+	struct stat st;
+	if (fstat(fd, &st) || (size_t)st.st_size < sizeof(IndexHeader)) {
+		close(fd);
+		return;
+	}
+	void * map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) return;
+
+	const IndexHeader * header = map;
+	const IndexDir * dirs = (const IndexDir *)(header + 1);
+	const IndexFile * files = (const IndexFile *)(dirs + header->dir_count);
+	const char * strings = (const char *)(files + header->file_count);
+	size_t size = st.st_size;
+
+	// written by another version, for other options, or damaged: start over
+	int valid = memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) == 0
+	         && header->flags == (arg_mask & INDEX_ARG_MASK)
+	         && header->dir_count > 0
+	         && sizeof(*header) + (uint64_t)header->dir_count * sizeof(*dirs)
+	            + (uint64_t)header->file_count * sizeof(*files) + header->strings_size == size
+	         && header->strings_size > 0 && strings[header->strings_size-1] == '\0';
+	for (uint32_t i=0; valid && i < header->dir_count; ++i) {
+		const IndexDir * dir = &dirs[i];
+		valid = dir->name < header->strings_size
+		     && (uint64_t)dir->first_file + dir->file_count <= header->file_count
+		     && (uint64_t)dir->first_child + dir->child_count <= header->dir_count
+		     && (dir->child_count == 0 || dir->first_child > i);
+	}
+	for (uint32_t i=0; valid && i < header->file_count; ++i) {
+		valid = files[i].name < header->strings_size;
+	}
+	if (!valid) {
+		munmap(map, size);
+		return;
+	}
+
+	gIndex.header = header;
+	gIndex.dirs = dirs;
+	gIndex.files = files;
+	gIndex.strings = strings;
+	gIndex.size = size;
+}
+
+static void
+index_unload() {
+	if (gIndex.header) munmap((void *)gIndex.header, gIndex.size);
+	memset(&gIndex, 0, sizeof(gIndex));
+}
+
+static void
+index_stamp(IndexDir * stamp, const struct stat * st) {
+	stamp->dev = st->st_dev;
+	stamp->ino = st->st_ino;
+	stamp->mtime_sec = st->st_mtim.tv_sec;
+	stamp->mtime_nsec = st->st_mtim.tv_nsec;
+	stamp->ctime_sec = st->st_ctim.tv_sec;
+	stamp->ctime_nsec = st->st_ctim.tv_nsec;
+}
+
+static int
+index_stamp_equal(const IndexDir * a, const IndexDir * b) {
+	return a->dev == b->dev && a->ino == b->ino
+	    && a->mtime_sec == b->mtime_sec && a->mtime_nsec == b->mtime_nsec
+	    && a->ctime_sec == b->ctime_sec && a->ctime_nsec == b->ctime_nsec;
+}
+
+// returns the index of the child of dir called name, or -1
+static int
+index_find_child(int dir, const char * name) {
+	if (dir < 0) return -1;
+	int lo = gIndex.dirs[dir].first_child;
+	int hi = lo + gIndex.dirs[dir].child_count;
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		int diff = strcmp(name, gIndex.strings + gIndex.dirs[mid].name);
+		if (diff == 0) return mid;
+		if (diff < 0) hi = mid;
+		else lo = mid + 1;
+	}
+	return -1;
+}
+
+// directories are opened relative to their parent with openat, so every
+// ScanDir only stores its own name. full paths are built once per entry
+// when the results are merged.
+typedef struct ScanDir ScanDir;
+struct ScanDir {
+	const char * name;     // path component, or the path passed to find_recursive for the root
+	ScanDir    * parent;
+	int fd;
+	int refs;              // the scan itself plus children that have not been opened yet
+	int dir_id;            // EntryTable directory, set while merging
+	char      ** files;    // stb array of names, readdir order
+	ScanDir   ** children; // stb array, readdir order
+	int cached;            // gIndex directory this one was found as, or -1
+	int from_cache;        // files and children were taken from the index
+	uint32_t index_id;     // position in gIndexBuilder.dirs
+	IndexDir stamp;        // only filled in with --index
+};
+
+typedef struct ScanWorker {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	ScanDir ** deque; // owner pops from the end, thieves steal from deque_head
+	int deque_head;
+	ArenaCursor cursor;
+	char * dir_buffer; // DIR_BUFFER_SIZE bytes for DirReader
+	char ** unknown;   // names whose d_type was DT_UNKNOWN in the current directory
+	unsigned char * unknown_types;
+#if defined(__linux__)
+	Uring ring;
+	int ring_state; // 0 not set up yet, 1 ready, -1 unavailable
+#endif
+} ScanWorker;
+
+static struct {
+	ScanWorker * workers;
+	int count;
+	pthread_mutex_t idle_lock;
+	pthread_cond_t idle_cond;
+	int idle;     // number of workers waiting on idle_cond
+	long queued;  // directories sitting in a deque
+	long pending; // directories queued or being scanned
+	long files;   // entries found so far
+	int error;
+} gScan;
+
+// the index being written for the next run, filled in while merging.
+// files are in the same order as the merged file list
+static struct {
+	IndexDir * dirs;
+	IndexFile * files;
+	char * strings;
+	time_t scan_time;
+} gIndexBuilder;
+
+static void
+fprint_scan_path(FILE * file, const ScanDir * dir) {
+	if (dir->parent) {
+		fprint_scan_path(file, dir->parent);
+		if (dir->parent->parent || strcmp(dir->parent->name, ".") != 0)
+			fputc('/', file);
+	}
+	fputs(dir->name, file);
+}
+
+static void
+scan_release(ScanDir * dir) {
+	if (__atomic_sub_fetch(&dir->refs, 1, __ATOMIC_SEQ_CST) == 0 && dir->fd >= 0) {
+		close(dir->fd);
+		dir->fd = -1;
+	}
+}
+
+static void
+scan_push(ScanWorker * worker, ScanDir * dir) {
+	__atomic_add_fetch(&gScan.pending, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_lock(&worker->lock);
+	arrput(worker->deque, dir);
+	pthread_mutex_unlock(&worker->lock);
+	__atomic_add_fetch(&gScan.queued, 1, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&gScan.idle, __ATOMIC_SEQ_CST) > 0) {
+		pthread_mutex_lock(&gScan.idle_lock);
+		pthread_cond_signal(&gScan.idle_cond);
+		pthread_mutex_unlock(&gScan.idle_lock);
+	}
+}
+
+static ScanDir *
+scan_take(ScanWorker * worker, int steal) {
+	ScanDir * dir = NULL;
+	pthread_mutex_lock(&worker->lock);
+	if (arrlen(worker->deque) > worker->deque_head) {
+		if (steal) {
+			dir = worker->deque[worker->deque_head++];
+		} else {
+			dir = arrpop(worker->deque);
+		}
+		if (arrlen(worker->deque) == worker->deque_head) {
+			arrsetlen(worker->deque, 0);
+			worker->deque_head = 0;
+		}
+	}
+	pthread_mutex_unlock(&worker->lock);
+	if (dir) __atomic_sub_fetch(&gScan.queued, 1, __ATOMIC_SEQ_CST);
+	return dir;
+}
+
+// names are kept in gArena so the merge can refer to them where they are
+static char *
+scan_push_name(ScanWorker * worker, const char * name) {
+	char * stored = Arena_push_string(&gArena, &worker->cursor, name, strlen(name));
+	if (!stored) {
+		if (!gScan.error) fprintf(stderr, "out of memory\n");
+		gScan.error = 1;
+	}
+	return stored;
+}
+
+static void
+scan_add_child(ScanWorker * worker, ScanDir * dir, char * name, int cached) {
+	ScanDir * child = calloc(1, sizeof(*child));
+	child->name = name;
+	child->parent = dir;
+	child->fd = -1;
+	child->refs = 1;
+	child->cached = cached;
+	arrput(dir->children, child);
+	__atomic_add_fetch(&dir->refs, 1, __ATOMIC_SEQ_CST);
+	scan_push(worker, child);
+}
+
+static void
+scan_entry(ScanWorker * worker, ScanDir * dir, char * name, unsigned char type) {
+	if (type == ((arg_mask & ARG_DMODE) ? DT_DIR : DT_REG)) {
+		arrput(dir->files, name);
+	}
+	if (type == DT_DIR && (arg_mask & ARG_RECUR) && !gScan.error) {
+		scan_add_child(worker, dir, name, index_find_child(dir->cached, name));
+	}
+}
+
+// takes the listing of an unchanged directory from the index
+static void
+scan_cached(ScanWorker * worker, ScanDir * dir) {
+	const IndexDir * cached = &gIndex.dirs[dir->cached];
+	dir->from_cache = 1;
+	for (uint32_t i=0; i < cached->file_count; ++i) {
+		arrput(dir->files, (char *)gIndex.strings + gIndex.files[cached->first_file + i].name);
+	}
+	for (uint32_t i=0; i < cached->child_count && !gScan.error; ++i) {
+		int id = cached->first_child + i;
+		scan_add_child(worker, dir, (char *)gIndex.strings + gIndex.dirs[id].name, id);
+	}
+}
+
+static unsigned char
+mode_to_d_type(mode_t mode) {
+	if (S_ISREG(mode)) return DT_REG;
+	if (S_ISDIR(mode)) return DT_DIR;
+	return DT_UNKNOWN;
+}
+
+#if defined(__linux__)
+#define UNKNOWN_RING_ENTRIES 64
+#define UNKNOWN_RING_MIN 8 // smaller batches are not worth a ring round trip
+
+static const char *
+scan_unknown_name(void * data, int index, char * scratch) {
+	(void)scratch;
+	return ((ScanWorker *)data)->unknown[index];
+}
+
+static void
+scan_unknown_done(void * data, int index, const struct statx * stx) {
+	((ScanWorker *)data)->unknown_types[index] = mode_to_d_type(stx->stx_mode);
+}
+#endif
+
+// some filesystems (NFS, FUSE, some XFS setups) report DT_UNKNOWN.
+// those names are collected per directory and their types are looked up
+// in one batch, on the worker's own ring when the batch is large enough
+static void
+scan_resolve_unknown(ScanWorker * worker, ScanDir * dir) {
+	int count = arrlen(worker->unknown);
+	arrsetlen(worker->unknown_types, count);
+
+	int resolved = 0;
+#if defined(__linux__)
+	if (count >= UNKNOWN_RING_MIN && worker->ring_state == 0) {
+		worker->ring_state = -1;
+		if (Uring_init(&worker->ring, UNKNOWN_RING_ENTRIES) == 0) {
+			if (Uring_supports(&worker->ring, IORING_OP_STATX)) {
+				worker->ring_state = 1;
+			} else {
+				Uring_destroy(&worker->ring);
+			}
+		}
+	}
+	if (count >= UNKNOWN_RING_MIN && worker->ring_state == 1) {
+		StatxBatch batch = {
+			dir->fd, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC, STATX_TYPE, count,
+			scan_unknown_name, scan_unknown_done, worker
+		};
+		resolved = Uring_statx(&worker->ring, &batch) == 0;
+		if (!resolved) {
+			// completions of the failed batch would be taken for the next one's
+			worker->ring_state = -1;
+			Uring_destroy(&worker->ring);
+		}
+	}
+#endif
+	if (!resolved) {
+		for (int i=0; i < count; ++i) {
+			struct stat st;
+			if (fstatat(dir->fd, worker->unknown[i], &st, AT_SYMLINK_NOFOLLOW)) {
+				worker->unknown_types[i] = DT_UNKNOWN;
+			} else {
+				worker->unknown_types[i] = mode_to_d_type(st.st_mode);
+			}
+		}
+	}
+
+	for (int i=0; i < count; ++i) {
+		scan_entry(worker, dir, worker->unknown[i], worker->unknown_types[i]);
+	}
+	arrsetlen(worker->unknown, 0);
+}
+
+static void
+scan_directory(ScanWorker * worker, ScanDir * dir) {
+	int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+	if (dir->parent) {
+		dir->fd = openat(dir->parent->fd, dir->name, flags);
+		scan_release(dir->parent);
+	} else {
+		dir->fd = open(dir->name, flags);
+	}
+
+	if (gIndexPath && dir->fd >= 0) {
+		struct stat st;
+		if (fstat(dir->fd, &st) == 0) {
+			index_stamp(&dir->stamp, &st);
+		}
+		if (dir->cached >= 0) {
+			const IndexDir * cached = &gIndex.dirs[dir->cached];
+			if (index_stamp_equal(cached, &dir->stamp)) {
+				scan_cached(worker, dir);
+				scan_release(dir);
+				return;
+			}
+			if (cached->dev != dir->stamp.dev || cached->ino != dir->stamp.ino) {
+				dir->cached = -1; // not the same directory anymore
+			}
+		}
+	}
+
+	DirReader reader;
+	if (dir->fd < 0 || DirReader_open(&reader, dir->fd, worker->dir_buffer, DIR_BUFFER_SIZE)) {
+		fputs("could not open directory \"", stderr);
+		fprint_scan_path(stderr, dir);
+		fputs("\"\n", stderr);
+		gScan.error = 1;
+		scan_release(dir);
+		return;
+	}
+
+	unsigned char open_type = (arg_mask & ARG_DMODE) ? DT_DIR : DT_REG;
+	int recur = (arg_mask & ARG_RECUR) != 0;
+	int hidden = (arg_mask & ARG_HIDDEN) != 0;
+	const char * name;
+	unsigned char type;
+	while ((name = DirReader_next(&reader, &type)) != NULL) {
+		if (name[0] == '.' && !hidden) continue;
+		if (type != DT_UNKNOWN && type != open_type && !(type == DT_DIR && recur)) continue;
+
+		char * stored = scan_push_name(worker, name);
+		if (!stored) break;
+		if (type == DT_UNKNOWN) {
+			arrput(worker->unknown, stored);
+			continue;
+		}
+		scan_entry(worker, dir, stored, type);
+	}
+	DirReader_close(&reader);
+
+	if (arrlen(worker->unknown) > 0) {
+		scan_resolve_unknown(worker, dir);
+	}
+	scan_release(dir);
+}
+
+static void *
+scan_worker(void * data) {
+	ScanWorker * self = data;
+	int self_index = self - gScan.workers;
+	for (;;) {
+		ScanDir * dir = scan_take(self, 0);
+		for (int i=1; dir == NULL && i < gScan.count; ++i) {
+			dir = scan_take(&gScan.workers[(self_index + i) % gScan.count], 1);
+		}
+
+		if (dir) {
+			scan_directory(self, dir);
+			__atomic_add_fetch(&gScan.files, arrlen(dir->files), __ATOMIC_RELAXED);
+			if (__atomic_sub_fetch(&gScan.pending, 1, __ATOMIC_SEQ_CST) == 0) {
+				pthread_mutex_lock(&gScan.idle_lock);
+				pthread_cond_broadcast(&gScan.idle_cond);
+				pthread_mutex_unlock(&gScan.idle_lock);
+			}
+			continue;
+		}
+
+		// nothing to take; sleep until something is pushed or the scan is over
+		pthread_mutex_lock(&gScan.idle_lock);
+		__atomic_add_fetch(&gScan.idle, 1, __ATOMIC_SEQ_CST);
+		while (__atomic_load_n(&gScan.queued, __ATOMIC_SEQ_CST) == 0
+		    && __atomic_load_n(&gScan.pending, __ATOMIC_SEQ_CST) != 0)
+		{
+			pthread_cond_wait(&gScan.idle_cond, &gScan.idle_lock);
+		}
+		__atomic_sub_fetch(&gScan.idle, 1, __ATOMIC_SEQ_CST);
+		int done = __atomic_load_n(&gScan.pending, __ATOMIC_SEQ_CST) == 0;
+		pthread_mutex_unlock(&gScan.idle_lock);
+		if (done) break;
+	}
+	return NULL;
+}
+
+static uint32_t
+index_add_string(const char * str) {
+	size_t len = strlen(str) + 1;
+	uint32_t offset = arrlen(gIndexBuilder.strings);
+	memcpy(arraddnptr(gIndexBuilder.strings, len), str, len);
+	return offset;
+}
+
+static int
+compare_scan_dir_names(const void * a, const void * b) {
+	return strcmp((*(ScanDir **)a)->name, (*(ScanDir **)b)->name);
+}
+
+// adds dir and its files to gIndexBuilder and reserves its children
+static void
+index_record(ScanDir * dir) {
+	IndexDir record = dir->stamp;
+	if (record.mtime_sec >= gIndexBuilder.scan_time - 1 || record.ctime_sec >= gIndexBuilder.scan_time - 1) {
+		// changes later in the same second would not move the timestamps
+		record.mtime_nsec = record.ctime_nsec = UINT32_MAX;
+	}
+	record.name = index_add_string(dir->parent ? dir->name : ".");
+	record.first_file = arrlen(gIndexBuilder.files);
+	record.file_count = arrlen(dir->files);
+	for (int i=0; i < arrlen(dir->files); ++i) {
+		IndexFile file = {0};
+		if (dir->from_cache) {
+			file = gIndex.files[gIndex.dirs[dir->cached].first_file + i];
+		}
+		file.name = index_add_string(dir->files[i]);
+		arrput(gIndexBuilder.files, file);
+	}
+
+	int child_count = arrlen(dir->children);
+	record.first_child = arrlen(gIndexBuilder.dirs);
+	record.child_count = child_count;
+	if (child_count > 0) {
+		ScanDir ** sorted = malloc(child_count * sizeof(*sorted));
+		memcpy(sorted, dir->children, child_count * sizeof(*sorted));
+		qsort(sorted, child_count, sizeof(*sorted), compare_scan_dir_names);
+		for (int i=0; i < child_count; ++i) {
+			sorted[i]->index_id = record.first_child + i;
+		}
+		free(sorted);
+		arrsetlen(gIndexBuilder.dirs, arrlen(gIndexBuilder.dirs) + child_count);
+	}
+	gIndexBuilder.dirs[dir->index_id] = record;
+}
+
+// scans dir_name with a pool of gJobs work-stealing threads. if stream
+// is not NULL every entry is also written to it as a line when it is
+// added, in entry order.
+// the results are merged in a depth-first walk of the directory tree
+// so the output does not depend on how the work was scheduled
+static int
+find_recursive(const char * dir_name, EntryTable * entries, LineWriter * stream) {
+	int count = (arg_mask & ARG_RECUR) ? job_count() : 1;
+
+	if (arg_mask & ARG_RECUR) {
+		// every directory with unopened children keeps a descriptor open
+		struct rlimit limit;
+		if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+			limit.rlim_cur = limit.rlim_max;
+			setrlimit(RLIMIT_NOFILE, &limit);
+		}
+	}
+
+	memset(&gScan, 0, sizeof(gScan));
+	gScan.count = count;
+	gScan.workers = calloc(count, sizeof(*gScan.workers));
+	pthread_mutex_init(&gScan.idle_lock, NULL);
+	pthread_cond_init(&gScan.idle_cond, NULL);
+	for (int i=0; i < count; ++i) {
+		pthread_mutex_init(&gScan.workers[i].lock, NULL);
+		gScan.workers[i].dir_buffer = malloc(DIR_BUFFER_SIZE);
+	}
+
+	if (gIndexPath) {
+		index_load(gIndexPath);
+		gIndexBuilder.scan_time = time(NULL);
+	}
+
+	ScanDir * root = calloc(1, sizeof(*root));
+	root->name = dir_name;
+	root->fd = -1;
+	root->refs = 1;
+	root->cached = gIndex.header ? 0 : -1;
+	scan_push(&gScan.workers[0], root);
+
+	int started = 1;
+	while (started < count) {
+		if (pthread_create(&gScan.workers[started].thread, NULL, scan_worker, &gScan.workers[started]))
+			break;
+		started++;
+	}
+	// a worker that failed to start has an empty deque, stealing from it
+	// finds nothing, so gScan.count is left alone while the others read it
+	scan_worker(&gScan.workers[0]);
+	for (int i=1; i < started; ++i) {
+		pthread_join(gScan.workers[i].thread, NULL);
+	}
+
+	// merge, adding every directory path once
+	arrsetcap(entries->parent, arrlen(entries->parent) + gScan.files);
+	arrsetcap(entries->name, arrlen(entries->name) + gScan.files);
+	arrsetcap(entries->depth, arrlen(entries->depth) + gScan.files);
+	arrsetcap(entries->ext, arrlen(entries->ext) + gScan.files);
+	root->dir_id = entry_add_dir(entries, "", 0, strcmp(dir_name, ".") == 0 ? "" : dir_name);
+
+	if (gIndexPath) {
+		arrsetlen(gIndexBuilder.dirs, 1);
+		root->index_id = 0;
+	}
+
+	ScanDir ** stack = NULL;
+	arrput(stack, root);
+	while (arrlen(stack) > 0) {
+		ScanDir * dir = arrpop(stack);
+		if (gIndexPath) {
+			index_record(dir);
+		}
+		int error = dir->dir_id < 0 && arrlen(dir->files) + arrlen(dir->children) > 0;
+		for (int i=0; i < arrlen(dir->files) && !error; ++i) {
+			error = entry_add(entries, dir->dir_id, dir->files[i]);
+			if (stream && !error) {
+				LineWriter_put(stream, arena_string(entries->dir_path[dir->dir_id]), entries->dir_path_len[dir->dir_id], dir->files[i]);
+			}
+		}
+		for (int i=arrlen(dir->children)-1; i >= 0; --i) {
+			ScanDir * child = dir->children[i];
+			child->dir_id = -1;
+			if (!error && arrlen(child->files) + arrlen(child->children) > 0) {
+				const char * path = arena_string(entries->dir_path[dir->dir_id]);
+				child->dir_id = entry_add_dir(entries, path, entries->dir_path_len[dir->dir_id], child->name);
+				error = child->dir_id < 0;
+			}
+			arrput(stack, child);
+		}
+		if (error && !gScan.error) {
+			if (dir->dir_id >= 0) {
+				const char * path = arena_string(entries->dir_path[dir->dir_id]);
+				fprintf(stderr, "path too long or too many files in \"%s\"\n", path);
+			} else {
+				fprintf(stderr, "path too long \"%s\"\n", dir_name);
+			}
+			gScan.error = 1;
+		}
+		arrfree(dir->files);
+		arrfree(dir->children);
+		free(dir);
+	}
+	arrfree(stack);
+
+	for (int i=0; i < count; ++i) {
+		ScanWorker * worker = &gScan.workers[i];
+		arrfree(worker->deque);
+		free(worker->dir_buffer);
+		arrfree(worker->unknown);
+		arrfree(worker->unknown_types);
+#if defined(__linux__)
+		if (worker->ring_state == 1) Uring_destroy(&worker->ring);
+#endif
+		pthread_mutex_destroy(&worker->lock);
+	}
+	free(gScan.workers);
+	pthread_mutex_destroy(&gScan.idle_lock);
+	pthread_cond_destroy(&gScan.idle_cond);
+	index_unload();
+
+	return gScan.error ? -1 : 0;
+}
+
+// fills in the fields of the entry's key tuple that --order uses
+static void
+stat_store(uint32_t entry, int64_t size, int64_t mtime) {
+	int64_t * key = entry_key(entry);
+	if (gSortKeySize >= 0) key[gSortKeySize] = size;
+	if (gSortKeyDate >= 0) key[gSortKeyDate] = mtime;
+}
+
+static void
+stat_one(uint32_t entry, unsigned int mask) {
+	char path [PATH_MAX];
+	entry_path(entry, path);
+#if defined(__linux__)
+	struct statx stx;
+	if (statx(AT_FDCWD, path, AT_STATX_DONT_SYNC, mask, &stx)) {
+		stat_store(entry, 0, 0);
+		return;
+	}
+	stat_store(entry, stx.stx_size, stx.stx_mtime.tv_sec);
+#else
+	struct stat st;
+	if (stat(path, &st)) {
+		stat_store(entry, 0, 0);
+		return;
+	}
+	stat_store(entry, st.st_size, st.st_mtime);
+#endif
+}
+
+// the entries to stat: subset[0..count), or every entry if subset is NULL
+typedef struct StatJob {
+	const uint32_t * subset;
+	int count;
+	unsigned int mask;
+	int next;
+} StatJob;
+
+#define STAT_JOB_CHUNK 256
+
+static inline uint32_t
+stat_job_entry(const StatJob * job, int index) {
+	return job->subset ? job->subset[index] : (uint32_t)index;
+}
+
+static void *
+stat_worker(void * data) {
+	StatJob * job = data;
+	for (;;) {
+		int start = __atomic_fetch_add(&job->next, STAT_JOB_CHUNK, __ATOMIC_RELAXED);
+		if (start >= job->count) break;
+		int end = start + STAT_JOB_CHUNK;
+		if (end > job->count) end = job->count;
+		for (int i=start; i < end; ++i) {
+			stat_one(stat_job_entry(job, i), job->mask);
+		}
+	}
+	return NULL;
+}
+
+#if defined(__linux__)
+#define STAT_RING_ENTRIES 256
+
+static const char *
+stat_list_name(void * data, int index, char * scratch) {
+	return entry_path(stat_job_entry(data, index), scratch);
+}
+
+static void
+stat_list_done(void * data, int index, const struct statx * stx) {
+	StatJob * job = data;
+	stat_store(stat_job_entry(job, index), stx->stx_size, stx->stx_mtime.tv_sec);
+}
+
+static int
+stat_list_uring(StatJob * job) {
+	Uring ring;
+	if (Uring_init(&ring, STAT_RING_ENTRIES)) return -1;
+	int result = -1;
+	if (Uring_supports(&ring, IORING_OP_STATX)) {
+		StatxBatch batch = {
+			AT_FDCWD, AT_STATX_DONT_SYNC, job->mask, job->count,
+			stat_list_name, stat_list_done, job
+		};
+		result = Uring_statx(&ring, &batch);
+	}
+	Uring_destroy(&ring);
+	return result;
+}
+#endif
+
+// fills in the key tuples in gEntries.key with the size (STATX_SIZE) and/or
+// modification time (STATX_MTIME) of the entries in subset, or of every
+// entry if subset is NULL. requests are batched through io_uring; when
+// that is not available the files are stat'ed by a pool of threads instead
+static void
+stat_list(const uint32_t * subset, int count, unsigned int mask) {
+	arrsetlen(gEntries.key, arrlen(gEntries.name) * gSortKeyWidth);
+	StatJob job = { subset, count, mask, 0 };
+#if defined(__linux__)
+	if (stat_list_uring(&job) == 0) return;
+#endif
+	int threads = job_count();
+	if (threads > count / STAT_JOB_CHUNK + 1) threads = count / STAT_JOB_CHUNK + 1;
+	run_threads(stat_worker, &job, threads);
+}
+
+// like stat_list, but takes the values the index already has and
+// stores the new ones in gIndexBuilder
+static void
+index_stat_list(unsigned int mask) {
+	uint32_t flags = 0;
+	if (mask & STATX_SIZE) flags |= INDEX_HAS_SIZE;
+	if (mask & STATX_MTIME) flags |= INDEX_HAS_MTIME;
+	int count = arrlen(gEntries.name);
+	arrsetlen(gEntries.key, count * gSortKeyWidth);
+	uint32_t * todo = NULL;
+	for (int i=0; i < count; ++i) {
+		const IndexFile * file = &gIndexBuilder.files[i];
+		if ((file->flags & flags) == flags) {
+			stat_store(i, file->size, file->mtime);
+		} else {
+			arrput(todo, i);
+		}
+	}
+
+	stat_list(todo, arrlen(todo), mask);
+	for (int t=0; t < arrlen(todo); ++t) {
+		IndexFile * file = &gIndexBuilder.files[todo[t]];
+		const int64_t * key = entry_key(todo[t]);
+		if (gSortKeySize >= 0) file->size = key[gSortKeySize];
+		if (gSortKeyDate >= 0) file->mtime = key[gSortKeyDate];
+		file->flags |= flags;
+	}
+	arrfree(todo);
+}
+
+// writes gIndexBuilder next to path and moves it into place
+static void
+index_write(const char * path) {
+	IndexHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+	header.flags = arg_mask & INDEX_ARG_MASK;
+	header.dir_count = arrlen(gIndexBuilder.dirs);
+	header.file_count = arrlen(gIndexBuilder.files);
+	header.strings_size = arrlen(gIndexBuilder.strings);
+
+	size_t path_len = strlen(path);
+	char * temp_path = malloc(path_len + 8);
+	snprintf(temp_path, path_len + 8, "%s.XXXXXX", path);
+	int fd = mkstemp(temp_path);
+	int error = fd < 0
+	         || write_all(fd, &header, sizeof(header))
+	         || write_all(fd, gIndexBuilder.dirs, header.dir_count * sizeof(IndexDir))
+	         || write_all(fd, gIndexBuilder.files, header.file_count * sizeof(IndexFile))
+	         || write_all(fd, gIndexBuilder.strings, header.strings_size);
+	if (fd >= 0) {
+		error = close(fd) || error;
+		error = error || rename(temp_path, path);
+		if (error) unlink(temp_path);
+	}
+	if (error) {
+		fprintf(stderr, "failed to write index \"%s\"\n", path);
+	}
+	free(temp_path);
+
+	arrfree(gIndexBuilder.dirs);
+	arrfree(gIndexBuilder.files);
+	arrfree(gIndexBuilder.strings);
+}
+
+static int
+get_dir_name(char * ret_dir_name, const char * path) {
+	char * last_slash = strrchr(path, '/');
+	if (last_slash == NULL)
+		return 0;
+	size_t dir_name_size = last_slash - path;
+	strncpy(ret_dir_name, path, dir_name_size);
+	ret_dir_name[dir_name_size] = '\0';
+	return dir_name_size;
+}
+
+// resolves "//", "." and ".." in path without asking the filesystem, so
+// two spellings of one path are seen as one. ".." at the start of a
+// relative path stays. returns the new length
+static size_t
+normalize_path(char * path) {
+	int absolute = path[0] == '/';
+	char * base = path + absolute;
+	char * keep = base; // the leading ".." end here
+	char * out = base;
+	const char * p = base;
+	while (*p) {
+		const char * end = strchrnul(p, '/');
+		size_t n = end - p;
+		int dot = n == 1 && p[0] == '.';
+		int dot_dot = n == 2 && p[0] == '.' && p[1] == '.';
+		if (n == 0 || dot || (dot_dot && absolute && out == base)) {
+			// nothing to keep
+		} else if (dot_dot && out > keep) {
+			while (out > keep && out[-1] != '/') out--;
+			if (out > base) out--;
+		} else {
+			if (out > base) *out++ = '/';
+			memmove(out, p, n);
+			out += n;
+			if (dot_dot) keep = out;
+		}
+		p = *end ? end + 1 : end;
+	}
+	if (out == path) *out++ = '.';
+	*out = '\0';
+	return out - path;
+}
+
+// set on threads that apply moves in parallel. their lines are collected
+// there and printed in plan order
+static __thread char ** tMoveLog;
+
+static void
+rprintf(const char * format, ...) {
+	if (arg_mask & ARG_QUIET) return;
+	va_list args;
+	va_start(args, format);
+	if (tMoveLog) {
+		va_list copy;
+		va_copy(copy, args);
+		int len = vsnprintf(NULL, 0, format, copy);
+		va_end(copy);
+		if (len > 0) {
+			size_t used = arrlen(*tMoveLog);
+			arrsetlen(*tMoveLog, used + len + 1);
+			vsnprintf(*tMoveLog + used, len + 1, format, args);
+			arrsetlen(*tMoveLog, used + len);
+		}
+	} else {
+		vprintf(format, args);
+	}
+	va_end(args);
+}
+
+void
+get_bash_path(char * dest, const char * str) {
+	*dest++ = '"';
+	while (*str) {
+		if (*str == '"' || *str == '`' || *str == '\\' || *str == '$')
+			*dest++ = '\\';
+		*dest++ = *str;
+		str++;
+	}
+	*dest++ = '"';
+	*dest = '\0';
+}
+
+typedef struct {
+	const char * key;
+	int value;
+} PathSlot;
+
+// directories known to be there, so later moves into them cost no
+// syscalls. in directory mode the listed directories themselves move,
+// which would leave stale paths here, so nothing is kept then
+static PathSlot * gDirsKnown;
+static pthread_mutex_t gDirsLock = PTHREAD_MUTEX_INITIALIZER;
+
+static int
+dirs_known(const char * path) {
+	pthread_mutex_lock(&gDirsLock);
+	if (!gDirsKnown) sh_new_arena(gDirsKnown);
+	int known = shgeti(gDirsKnown, path) >= 0;
+	pthread_mutex_unlock(&gDirsLock);
+	return known;
+}
+
+static void
+dirs_add(const char * path) {
+	if (arg_mask & ARG_DMODE) return;
+	pthread_mutex_lock(&gDirsLock);
+	if (!gDirsKnown) sh_new_arena(gDirsKnown);
+	shput(gDirsKnown, path, 1);
+	pthread_mutex_unlock(&gDirsLock);
+}
+
+// like mkdir -p. path is cut at its slashes while the parents are made
+// and restored after. the lock is only held for the lookups, so threads
+// never wait on each other's syscalls; when two make the same directory
+// the one that gets EEXIST takes it as there. returns 1 if a directory
+// was made, 0 if path already was one, -1 on failure
+static int
+make_dirs(char * path, size_t len) {
+	if (dirs_known(path)) return 0;
+	int made = 0;
+	struct stat dir_stat;
+	if (stat(path, &dir_stat) == 0) {
+		if (!S_ISDIR(dir_stat.st_mode)) return -1;
+	} else if (mkdirat(AT_FDCWD, path, 0777) == 0) {
+		made = 1;
+	} else if (errno == ENOENT) {
+		char * slash = path + len - 1;
+		while (slash > path && *slash != '/') slash--;
+		if (slash == path) return -1;
+		*slash = '\0';
+		int result = make_dirs(path, slash - path);
+		*slash = '/';
+		if (result < 0) return -1;
+		if (mkdirat(AT_FDCWD, path, 0777) == 0) {
+			made = 1;
+		} else if (errno != EEXIST) {
+			return -1;
+		}
+	} else if (errno != EEXIST) {
+		return -1;
+	}
+	dirs_add(path);
+	return made;
+}
+
+static int
+remove_empty_recursive(const char * dir_path) {
+	char dir_name [PATH_MAX];
+	int dir_name_size = get_dir_name(dir_name, dir_path);
+	if (dir_name_size == 0) return 0;
+
+	// only the first entry matters, so a small buffer is enough
+	long buffer [512];
+	DirReader reader;
+	int fd = open(dir_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0 && errno == ENOENT) return 0; // removed with an earlier move
+	if (fd < 0 || DirReader_open(&reader, fd, (char *)buffer, sizeof(buffer))) {
+		if (fd >= 0) close(fd);
+		fprintf(stderr, "failed to open %s\n", dir_name);
+		return -1;
+	}
+	unsigned char type;
+	int file_count = DirReader_next(&reader, &type) != NULL;
+	DirReader_close(&reader);
+	close(fd);
+
+	if (file_count == 0) {
+		if (remove(dir_name) == 0) {
+			pthread_mutex_lock(&gDirsLock);
+			(void)shdel(gDirsKnown, dir_name);
+			pthread_mutex_unlock(&gDirsLock);
+		}
+		char arg [PATH_MAX];
+		get_bash_path(arg, dir_name);
+		rprintf("rm -r %s\n", arg);
+		return remove_empty_recursive(dir_name);
+	} else {
+		return 0;
+	}
+}
+
+sort_function_t
+get_sort_function_from_string(const char * str, size_t len) {
+	if (len == 4 && strncmp(str, "name", len) == 0) {
+		return sort_function_name;
+	} else if (len == 4 && strncmp(str, "size", len) == 0) {
+		return sort_function_size;
+	} else if (len == 4 && strncmp(str, "date", len) == 0) {
+		return sort_function_mod;
+	} else if (len == 4 && strncmp(str, "type", len) == 0) {
+		return sort_function_type;
+	} else {
+		fprintf(stderr, "unknown sort order \"%.*s\".\n", (int)len, str);
+		return NULL;
+	}
+}
+
+// parses a list of keys separated by ',' into gSortOrder and lays out the
+// key tuple. "type:<key>" is the same as "type,<key>", and type at the
+// end is followed by name. "none" leaves gSortOrder empty
+int
+parse_sort_order(const char * str) {
+	gSortOrderCount = 0;
+	gSortKeyWidth = 0;
+	gSortKeySize = gSortKeyDate = -1;
+	if (strcmp(str, "none") == 0) return 0;
+	for (;;) {
+		size_t len = strcspn(str, ",:");
+		sort_function_t fn = get_sort_function_from_string(str, len);
+		if (fn == NULL) return -1;
+		// leaves room for the name after a trailing type
+		if (gSortOrderCount == SORT_ORDER_MAX - 1) {
+			fprintf(stderr, "too many sort keys, at most %d are supported.\n", SORT_ORDER_MAX - 1);
+			return -1;
+		}
+		gSortOrder[gSortOrderCount++] = fn;
+		if (fn == sort_function_size && gSortKeySize < 0) gSortKeySize = gSortKeyWidth++;
+		if (fn == sort_function_mod && gSortKeyDate < 0) gSortKeyDate = gSortKeyWidth++;
+
+		str += len;
+		if (*str == '\0') break;
+		if (*str == ':' && fn != sort_function_type) {
+			fprintf(stderr, "only type takes a ':'.\n");
+			return -1;
+		}
+		str++;
+	}
+	if (gSortOrder[gSortOrderCount-1] == sort_function_type) {
+		gSortOrder[gSortOrderCount++] = sort_function_name;
+	}
+	return 0;
+}
+
+// returns the first '\n', '\0' or '/' in [p, end), or end
+static inline const char *
+find_line_stop(const char * p, const char * end) {
+#if defined(__x86_64__)
+	const __m128i newline = _mm_set1_epi8('\n'), slash = _mm_set1_epi8('/');
+	const __m128i zero = _mm_setzero_si128();
+	for (; end - p >= 16; p += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)p);
+		__m128i stop = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, newline), _mm_cmpeq_epi8(v, slash)), _mm_cmpeq_epi8(v, zero));
+		unsigned int mask = _mm_movemask_epi8(stop);
+		if (mask) return p + __builtin_ctz(mask);
+	}
+#endif
+	for (; p < end; ++p) {
+		if (*p == '\n' || *p == '/' || *p == '\0') break;
+	}
+	return p;
+}
+
+#define EDIT_ERRORS_MAX 10
+
+static int
+edit_error(int * errors, int line, const char * format, ...) {
+	if (++*errors <= EDIT_ERRORS_MAX) {
+		va_list args;
+		va_start(args, format);
+		fprintf(stderr, "line %d: ", line);
+		vfprintf(stderr, format, args);
+		fputc('\n', stderr);
+		va_end(args);
+	}
+	return 1;
+}
+
+// splits the edited buffer into count lines, lines[i] up to lines[i+1]-1,
+// and checks the new names in the same pass. a missing newline at the
+// end is fine. returns -1 after reporting what is wrong
+static int
+split_edit_buffer(const char * data, size_t size, int count, const char ** lines) {
+	const char * p = data;
+	const char * end = data + size;
+	int line = 0;
+	int errors = 0;
+	while (p < end) {
+		if (line == count) {
+			line++;
+			break;
+		}
+		lines[line] = p;
+		const char * component = p;
+		int bad = 0;
+		for (;;) {
+			const char * stop = find_line_stop(p, end);
+			if (stop - component > NAME_MAX && !bad && lines[line][0] != '#') {
+				bad = edit_error(&errors, line+1, "name is longer than NAME_MAX");
+			}
+			if (stop == end || *stop == '\n') {
+				p = stop;
+				break;
+			}
+			if (*stop == '\0' && !bad) {
+				bad = edit_error(&errors, line+1, "contains a NUL byte");
+			}
+			p = component = stop + 1;
+		}
+		size_t len = p - lines[line];
+		if (len == 0) {
+			edit_error(&errors, line+1, "is empty, start it with '#' to delete the file");
+		} else if (lines[line][0] != '#' && !bad && len >= PATH_MAX) {
+			edit_error(&errors, line+1, "path is longer than PATH_MAX");
+		}
+		p++; // past the newline
+		line++;
+	}
+	lines[line < count ? line : count] = p;
+
+	if (line != count) {
+		fprintf(stderr, "line count was changed, no action can be taken\n");
+		return -1;
+	}
+	if (errors) {
+		if (errors > EDIT_ERRORS_MAX) fprintf(stderr, "and %d more\n", errors - EDIT_ERRORS_MAX);
+		fprintf(stderr, "no action can be taken\n");
+		return -1;
+	}
+	return 0;
+}
+
+// creates the edit buffer in the first directory that takes it, tmpfs
+// ones first so it stays in memory. mkstemps picks a name no other
+// session uses in one step and creates the file only readable by us.
+// returns the descriptor and the path in path, or -1
+static int
+create_temp_file(char * path, size_t size) {
+	const char * dirs [] = { getenv("XDG_RUNTIME_DIR"), "/dev/shm", getenv("TMPDIR"), FILEPATH_PREFIX };
+	for (size_t i=0; i < LENGTH(dirs); ++i) {
+		// the path is passed to the shell in single quotes
+		if (!dirs[i] || dirs[i][0] != '/' || strchr(dirs[i], '\'')) continue;
+		if (snprintf(path, size, "%s/blkmv-XXXXXX%s", dirs[i], FILEPATH_POSTFIX) >= (int)size) continue;
+		int fd = mkstemps(path, strlen(FILEPATH_POSTFIX));
+		if (fd >= 0) return fd;
+	}
+	return -1;
+}
+
+#if defined(__linux__)
+// called when a rename with RENAME_NOREPLACE failed with error. renames
+// anyway if the filesystem does not support the flag, or if new_name is
+// old_name under another name, as when only the case changes on a case
+// insensitive filesystem
+static int
+rename_fallback(const char * old_name, const char * new_name, int error) {
+	if (error == EEXIST) {
+		struct stat old_stat, new_stat;
+		if (lstat(old_name, &old_stat) || lstat(new_name, &new_stat)
+		 || old_stat.st_dev != new_stat.st_dev || old_stat.st_ino != new_stat.st_ino)
+		{
+			errno = EEXIST;
+			return -1;
+		}
+	} else if (error != EINVAL && error != ENOSYS && error != ENOTSUP) {
+		errno = error;
+		return -1;
+	}
+	return rename(old_name, new_name);
+}
+#endif
+
+// like rename, but fails instead of replacing a file at new_name
+static int
+rename_new(const char * old_name, const char * new_name) {
+#if defined(__linux__)
+	if (renameat2(AT_FDCWD, old_name, AT_FDCWD, new_name, RENAME_NOREPLACE) == 0) return 0;
+	return rename_fallback(old_name, new_name, errno);
+#else
+	return rename(old_name, new_name);
+#endif
+}
+
+int
+do_move(const char * old_name, const char * new_name) {
+	int same = strcmp(old_name, new_name) == 0;
+	if (same) return 0;
+
+	if (new_name[0] == '#') {
+		int error = remove(old_name);
+		char arg [PATH_MAX];
+		get_bash_path(arg, old_name);
+		rprintf("rm %s\n", arg);
+		if (error) rprintf(" # FAILED!");
+	} else {
+		char dir_name [PATH_MAX];
+		int dir_name_size = get_dir_name(dir_name, new_name);
+		if (dir_name_size) {
+			int made = make_dirs(dir_name, dir_name_size);
+			if (made < 0) {
+				fprintf(stderr, "failed to create directory '%s'\n", dir_name);
+				return -1;
+			}
+			if (made) {
+				char arg [PATH_MAX];
+				get_bash_path(arg, dir_name);
+				rprintf("mkdir -p %s\n", arg);
+			}
+		}
+		int error = rename_new(old_name, new_name);
+		char a1 [PATH_MAX], a2 [PATH_MAX];
+		get_bash_path(a1, old_name);
+		get_bash_path(a2, new_name);
+		rprintf("mv %s %s\n", a1, a2);
+		if (error) rprintf(" # FAILED!");
+	}
+	return 0;
+}
+
+// swaps two paths, through a temporary name when the filesystem cannot
+// exchange them in one step
+static int
+do_exchange(const char * a, const char * b) {
+	char a1 [PATH_MAX], a2 [PATH_MAX];
+	get_bash_path(a1, a);
+	get_bash_path(a2, b);
+#if defined(__linux__)
+	static int unsupported = 0;
+	if (!__atomic_load_n(&unsupported, __ATOMIC_RELAXED)) {
+		if (renameat2(AT_FDCWD, a, AT_FDCWD, b, RENAME_EXCHANGE) == 0) {
+			rprintf("mv --exchange %s %s\n", a1, a2);
+			return 0;
+		}
+		if (errno != EINVAL && errno != ENOSYS && errno != ENOTSUP) {
+			rprintf("mv --exchange %s %s\n", a1, a2);
+			rprintf(" # FAILED!");
+			return 0;
+		}
+		__atomic_store_n(&unsupported, 1, __ATOMIC_RELAXED);
+	}
+#endif
+	static unsigned int temp_count = 0;
+	char temp [PATH_MAX];
+	char dir_name [PATH_MAX];
+	int dir_name_size = get_dir_name(dir_name, a);
+	struct stat temp_stat;
+	do {
+		int len = snprintf(temp, sizeof(temp), "%s%s.blkmv-%d-%u", dir_name, dir_name_size ? "/" : "", (int)getpid(),
+		                   __atomic_fetch_add(&temp_count, 1, __ATOMIC_RELAXED));
+		if (len >= (int)sizeof(temp)) {
+			fprintf(stderr, "no temporary name next to '%s'\n", a);
+			return -1;
+		}
+	} while (lstat(temp, &temp_stat) == 0);
+
+	char t1 [PATH_MAX];
+	get_bash_path(t1, temp);
+	int error = rename_new(a, temp);
+	rprintf("mv %s %s\n", a1, t1);
+	if (error) {
+		rprintf(" # FAILED!");
+		return 0;
+	}
+	error = rename_new(b, a);
+	rprintf("mv %s %s\n", a2, a1);
+	if (error) rprintf(" # FAILED!");
+	error = rename_new(temp, error ? a : b);
+	rprintf("mv %s %s\n", t1, error ? a1 : a2);
+	if (error) rprintf(" # FAILED!");
+	return 0;
+}
+
+// the rename plan: each changed line becomes a move or a removal. a move
+// onto a path that another line moves away has to wait for that one, so
+// the moves form chains, run from the far end, and cycles, turned into
+// exchanges with the first path of the cycle. operations of one group
+// run in the order given, different groups do not touch the same paths
+enum {
+	MOVE_RENAME,
+	MOVE_REMOVE,
+	MOVE_EXCHANGE,
+};
+
+typedef struct {
+	const char * from;
+	const char * to;
+	uint32_t kind;
+	uint32_t group;
+} MoveOp;
+
+static void
+move_plan_put(MoveOp ** plan, int kind, const char * from, const char * to, uint32_t group) {
+	MoveOp op = { from, to, kind, group };
+	arrput(*plan, op);
+}
 
-#define STRING_BUCKET_CAPACITY 65536 // 64 KiB
-typedef struct StringBucket {
-	unsigned int length;
-	char * data;
-} StringBucket;
+// maps each path in from to its index. the keys are the caller's
+// strings, not copies
+static PathSlot *
+move_sources(const char ** from, int count) {
+	PathSlot * sources = NULL;
+	shdefault(sources, -1);
+	for (int i=0; i < count; i++) {
+		shput(sources, from[i], i);
+	}
+	return sources;
+}
 
-StringBucket
-StringBucket_create() {
-	StringBucket result;
+// what a path names, so two names of one file can be told apart from
+// two files
+typedef struct PathId {
+	int exists;
+	dev_t dev;
+	ino_t ino;
+} PathId;
+
+typedef struct ExistJob {
+	const char ** paths;
+	int count;
+	PathId * ids;
+	int next;
+} ExistJob;
+
+static void *
+exist_worker(void * data) {
+	ExistJob * job = data;
+	for (;;) {
+		int start = __atomic_fetch_add(&job->next, STAT_JOB_CHUNK, __ATOMIC_RELAXED);
+		if (start >= job->count) break;
+		int end = start + STAT_JOB_CHUNK;
+		if (end > job->count) end = job->count;
+		for (int i=start; i < end; ++i) {
+			struct stat st;
+			PathId * id = &job->ids[i];
+			id->exists = fstatat(AT_FDCWD, job->paths[i], &st, AT_SYMLINK_NOFOLLOW) == 0;
+			id->dev = id->exists ? st.st_dev : 0;
+			id->ino = id->exists ? st.st_ino : 0;
+		}
+	}
+	return NULL;
+}
 
-	result.length = 0;
-	result.data = malloc(STRING_BUCKET_CAPACITY);
+#if defined(__linux__)
+static const char *
+exist_name(void * data, int index, char * scratch) {
+	(void)scratch;
+	return ((ExistJob *)data)->paths[index];
+}
 
-	return result;
+static void
+exist_done(void * data, int index, const struct statx * stx) {
+	PathId * id = &((ExistJob *)data)->ids[index];
+	id->exists = stx->stx_mask != 0;
+	id->dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+	id->ino = stx->stx_ino;
 }
+#endif
 
-typedef int (*sort_function_t)(const FileInfo*, const FileInfo*);
+// fills in ids[i] for paths[i], following no symlinks
+static void
+paths_exist(const char ** paths, int count, PathId * ids) {
+	if (count == 0) return;
+	ExistJob job = { paths, count, ids, 0 };
+#if defined(__linux__)
+	Uring ring;
+	if (Uring_init(&ring, STAT_RING_ENTRIES) == 0) {
+		int result = -1;
+		if (Uring_supports(&ring, IORING_OP_STATX)) {
+			StatxBatch batch = {
+				AT_FDCWD, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC, STATX_TYPE | STATX_INO, count,
+				exist_name, exist_done, &job
+			};
+			result = Uring_statx(&ring, &batch);
+		}
+		Uring_destroy(&ring);
+		if (result == 0) return;
+	}
+#endif
+	int threads = job_count();
+	if (threads > count / STAT_JOB_CHUNK + 1) threads = count / STAT_JOB_CHUNK + 1;
+	run_threads(exist_worker, &job, threads);
+}
 
+// reports every target that two lines share, and every target that is
+// already there and not moved away by another line. a target that is
+// the line's own file under another name, as when only the case changes
+// on a case insensitive filesystem, is fine. line[i] is the line number
+// of the move. returns the number of problems
 static int
-count_slashes(const char * str) {
-	int result = 0;
-	while (*str != '\0') {
-		if (*str == '/')
-			result++;
-		str++;
+move_plan_check(const char ** from, const char ** to, const int * line, int count, PathSlot * sources) {
+	int errors = 0;
+	PathSlot * targets = NULL;
+	shdefault(targets, -1);
+	const char ** unknown = NULL;
+	int * unknown_move = NULL;
+	for (int i=0; i < count; i++) {
+		if (to[i][0] == '#') continue;
+		int other = shget(targets, to[i]);
+		if (other >= 0) {
+			edit_error(&errors, line[i], "moves to \"%s\" like line %d", to[i], line[other]);
+			continue;
+		}
+		shput(targets, to[i], i);
+		if (shget(sources, to[i]) < 0) {
+			arrput(unknown, to[i]);
+			arrput(unknown_move, i);
+		}
 	}
-	return result;
+	shfree(targets);
+
+	// the listing does not have hidden or unlisted files, ask the filesystem
+	int unknown_count = arrlen(unknown);
+	PathId * ids = calloc(unknown_count + 1, sizeof(*ids));
+	paths_exist(unknown, unknown_count, ids);
+	for (int u=0; u < unknown_count; u++) {
+		if (!ids[u].exists) continue;
+		int i = unknown_move[u];
+		struct stat st;
+		if (fstatat(AT_FDCWD, from[i], &st, AT_SYMLINK_NOFOLLOW) == 0
+		 && st.st_dev == ids[u].dev && st.st_ino == ids[u].ino) continue;
+		edit_error(&errors, line[i], "\"%s\" already exists", unknown[u]);
+	}
+	free(ids);
+	arrfree(unknown);
+	arrfree(unknown_move);
+
+	if (errors > EDIT_ERRORS_MAX) fprintf(stderr, "and %d more\n", errors - EDIT_ERRORS_MAX);
+	return errors;
 }
 
-static int gSortDirection = 1;
-static sort_function_t sort_function_child;
-static sort_function_t sort_function_type_next;
+// from[i] becomes to[i], a to starting with '#' removes it. returns the
+// operations in an order that never overwrites a path still to be moved
+static MoveOp *
+move_plan_build(const char ** from, const char ** to, int count, PathSlot * sources) {
+	// next[i] is the move that has to leave to[i] first
+	int * next = malloc(count * sizeof(*next));
+	uint32_t * group = malloc(count * sizeof(*group));
+	uint8_t * state = calloc(count, 1); // 0 waiting, 1 on the current path, 2 planned
+	uint8_t * has_pred = calloc(count, 1);
+	if (!next || !group || !state || !has_pred) {
+		free(next);
+		free(group);
+		free(state);
+		free(has_pred);
+		return NULL;
+	}
+	for (int i=0; i < count; i++) {
+		next[i] = to[i][0] == '#' ? -1 : shget(sources, to[i]);
+		if (next[i] >= 0) has_pred[next[i]] = 1;
+	}
 
-static int
-sort_function_prime(const void * voida, const void * voidb) {
-	const FileInfo * info_a = (FileInfo*)voida;
-	const FileInfo * info_b = (FileInfo*)voidb;
+	MoveOp * plan = NULL;
+	int * path = NULL;
+	uint32_t group_count = 0;
+	// chains first, from their heads in listing order, then the cycles
+	for (int pass=0; pass < 2; pass++) {
+		for (int start=0; start < count; start++) {
+			if (state[start] || (pass == 0 && has_pred[start])) continue;
+
+			arrsetlen(path, 0);
+			int n = start;
+			while (n >= 0 && state[n] == 0) {
+				state[n] = 1;
+				arrput(path, n);
+				n = next[n];
+			}
+			uint32_t g = n >= 0 && state[n] == 2 ? group[n] : group_count++;
+			int stop = arrlen(path);
+			if (n >= 0 && state[n] == 1) {
+				while (path[stop-1] != n) stop--;
+				stop--;
+				for (int j=stop+1; j < arrlen(path); j++) {
+					move_plan_put(&plan, MOVE_EXCHANGE, from[n], from[path[j]], g);
+				}
+				for (int j=stop; j < arrlen(path); j++) {
+					group[path[j]] = g;
+					state[path[j]] = 2;
+				}
+			}
+			for (int j=stop-1; j >= 0; j--) {
+				int i = path[j];
+				move_plan_put(&plan, to[i][0] == '#' ? MOVE_REMOVE : MOVE_RENAME, from[i], to[i], g);
+				group[i] = g;
+				state[i] = 2;
+			}
+		}
+	}
+	arrfree(path);
+	free(next);
+	free(group);
+	free(state);
+	free(has_pred);
+	return plan;
+}
 
-	int slash_diff = info_b->nslashes - info_a->nslashes;
-	if (slash_diff) return slash_diff;
+static int
+apply_op(const MoveOp * op) {
+	return op->kind == MOVE_EXCHANGE ? do_exchange(op->from, op->to) : do_move(op->from, op->to);
+}
 
-	return sort_function_child(info_a, info_b);
+// the groups of a plan are split by the directories their first move
+// leaves and enters, and a thread takes a whole part, so moves between
+// the same two directories do not contend for their locks in the kernel.
+// a directory can still be changed by several threads, as the source of
+// one part and the target of another. a directory lives on one device,
+// so the parts never span devices either.
+// in directory mode a directory may move while moves inside it are still
+// to come, which the listing avoids by putting deeper paths first. so an
+// operation only starts once every operation on a deeper path is done,
+// the threads run one depth level at a time. within a level, operations
+// on a path and on a path under it, as a move to e and one to e/f, are
+// put in one part and keep the order of the plan
+#define APPLY_PARALLEL_THRESHOLD 256 // below this one thread is faster
+#define APPLY_DONE UINT32_MAX
+
+typedef struct ApplyJob {
+	const MoveOp * plan;
+	int count;
+	uint16_t * depth;    // per operation: the level it runs at, see apply_depths
+	int level;           // operations this deep or deeper may run
+	uint32_t * after;    // per operation: the next one of its part, or APPLY_DONE
+	uint32_t * parts;    // per part: its next operation
+	int next;            // next part to take
+	int failed;
+	const char ** text;  // per operation: its output, NULL until it ran
+	int printed;         // operations before this one are printed
+	pthread_mutex_t lock;
+} ApplyJob;
+
+// stores the output of operation index and prints all that is ready in order
+static void
+apply_publish(ApplyJob * job, int index, const char * text) {
+	pthread_mutex_lock(&job->lock);
+	job->text[index] = text;
+	while (job->printed < job->count && job->text[job->printed]) {
+		fputs(job->text[job->printed++], stdout);
+	}
+	pthread_mutex_unlock(&job->lock);
 }
 
+// fills in job->depth: the number of slashes in the from of each
+// operation, or of an earlier one in its group when that has fewer, as
+// the operation has to wait for it. returns 0 when out of memory
 static int
-sort_function_name(const FileInfo * info_a, const FileInfo * info_b) {
-	const char * a = info_a->name;
-	const char * b = info_b->name;
-	while (*a != '\0' && *b != '\0') {
-		if (*a <= '9' && *a >= '0' && *b <= '9' && *b >= '0') {
-			char *a_num_end, *b_num_end;
-			long a_num = strtol(a, &a_num_end, 10);
-			long b_num = strtol(b, &b_num_end, 10);
-			long diff = a_num - b_num;
-			if (diff != 0)
-				return diff * gSortDirection;
-			else
-				a = a_num_end, b = b_num_end;
-		} else {
-			int diff = (int)*a - (int)*b;
-			if (diff == 0)
-				a++, b++;
-			else
-				return diff * gSortDirection;
+apply_depths(ApplyJob * job) {
+	job->depth = malloc((job->count + 1) * sizeof(*job->depth));
+	if (!job->depth) return 0;
+	for (int i=0; i < job->count; i++) {
+		int depth = 0;
+		for (const char * p = job->plan[i].from; *p; p++) depth += *p == '/';
+		if (i > 0 && job->plan[i].group == job->plan[i-1].group && job->depth[i-1] < depth) {
+			depth = job->depth[i-1];
 		}
+		job->depth[i] = depth;
 	}
-
-	return ((int)*a - (int)*b) * gSortDirection;
+	return 1;
 }
 
-static int
-sort_function_type(const FileInfo * info_a, const FileInfo * info_b) {
-	const char * a = strrchr(info_a->name, '.');
-	const char * b = strrchr(info_b->name, '.');
-	if (a && b) {
-		while (*a != '\0' && *b != '\0') {
-			int diff = (int)*a - (int)*b;
-			if (diff == 0)
-				a++, b++;
-			else
-				return diff * gSortDirection;
-		}
+static uint32_t
+apply_root(uint32_t * root, uint32_t i) {
+	while (root[i] != i) {
+		root[i] = root[root[i]];
+		i = root[i];
 	}
+	return i;
+}
 
-	return sort_function_type_next(info_a, info_b);
+static void
+apply_join(uint32_t * root, uint32_t a, uint32_t b) {
+	a = apply_root(root, a);
+	b = apply_root(root, b);
+	if (a != b) root[a > b ? a : b] = a > b ? b : a;
 }
 
+// splits the plan into parts: the operations of a group, and those of
+// one level where a path of one is above a path of the other, are in the
+// same part. with by_dirs the groups that leave and enter the same two
+// directories are as well. fills in job->after and job->parts, deepest
+// level first and in plan order within a level. needs job->depth,
+// returns 0 when out of memory
 static int
-sort_function_size(const FileInfo * info_a, const FileInfo * info_b) {
-	if (info_a->size < info_b->size)
-		return gSortDirection;
-	else if (info_a->size > info_b->size)
-		return -gSortDirection;
-	else
+apply_order(ApplyJob * job, int by_dirs) {
+	int count = job->count;
+	const MoveOp * plan = job->plan;
+	uint32_t * root = malloc((count + 1) * sizeof(*root));
+	uint32_t * last = malloc((count + 1) * sizeof(*last));
+	uint32_t * order = malloc((count + 1) * sizeof(*order));
+	job->after = malloc((count + 1) * sizeof(*job->after));
+	if (!root || !last || !order || !job->after) {
+		free(root);
+		free(last);
+		free(order);
 		return 0;
-}
+	}
+	for (int i=0; i < count; i++) {
+		root[i] = i;
+		if (i > 0 && plan[i].group == plan[i-1].group) root[i] = root[i-1];
+	}
 
-static int
-sort_function_mod(const FileInfo * info_a, const FileInfo * info_b) {
-	if (info_a->mod_time < info_b->mod_time)
-		return gSortDirection;
-	else if (info_a->mod_time > info_b->mod_time)
-		return -gSortDirection;
-	else
+	// the keys are the plan's strings. a path that is the from of one
+	// operation and the to of another links them into one group already
+	PathSlot * paths = NULL;
+	shdefault(paths, -1);
+	for (int i=0; i < count; i++) {
+		shput(paths, plan[i].from, i);
+		if (plan[i].kind != MOVE_REMOVE) shput(paths, plan[i].to, i);
+	}
+	for (int i=0; i < count; i++) {
+		for (int side=0; side < 2; side++) {
+			if (side == 1 && plan[i].kind == MOVE_REMOVE) break;
+			char path [PATH_MAX];
+			strcpy(path, side ? plan[i].to : plan[i].from);
+			for (int end=strlen(path)-1; end > 0; end--) {
+				if (path[end] != '/') continue;
+				path[end] = '\0';
+				int other = shget(paths, path);
+				if (other >= 0 && job->depth[other] == job->depth[i]) apply_join(root, i, other);
+			}
+		}
+	}
+	shfree(paths);
+
+	if (by_dirs) {
+		PathSlot * part_of = NULL;
+		sh_new_arena(part_of);
+		shdefault(part_of, -1);
+		for (int i=0; i < count; i++) {
+			if (i > 0 && plan[i].group == plan[i-1].group) continue;
+			// names cannot hold a newline, the edit buffer is split on them
+			char key [2 * PATH_MAX];
+			int len = get_dir_name(key, plan[i].from);
+			key[len++] = '\n';
+			key[len] = '\0';
+			if (plan[i].kind != MOVE_REMOVE) get_dir_name(key + len, plan[i].to);
+			int other = shget(part_of, key);
+			if (other >= 0) {
+				apply_join(root, i, other);
+			} else {
+				shput(part_of, key, i);
+			}
+		}
+		shfree(part_of);
+	}
+
+	// a stable counting sort by level, deepest first
+	int max_depth = 0;
+	for (int i=0; i < count; i++) {
+		if (job->depth[i] > max_depth) max_depth = job->depth[i];
+	}
+	int * start = calloc(max_depth + 2, sizeof(*start));
+	if (!start) {
+		free(root);
+		free(last);
+		free(order);
 		return 0;
+	}
+	for (int i=0; i < count; i++) start[max_depth - job->depth[i] + 1]++;
+	for (int d=1; d <= max_depth + 1; d++) start[d] += start[d-1];
+	for (int i=0; i < count; i++) order[start[max_depth - job->depth[i]]++] = i;
+	free(start);
+
+	for (int i=0; i < count; i++) last[i] = APPLY_DONE;
+	for (int k=0; k < count; k++) {
+		uint32_t i = order[k];
+		uint32_t r = apply_root(root, i);
+		if (last[r] == APPLY_DONE) {
+			arrput(job->parts, i);
+		} else {
+			job->after[last[r]] = i;
+		}
+		last[r] = i;
+		job->after[i] = APPLY_DONE;
+	}
+	free(root);
+	free(last);
+	free(order);
+	return 1;
 }
 
-static void
-paths_join(char * dest, int num_paths, const char * paths []) {
-	int dest_index = 0;
-	for (int path_index=0; path_index < num_paths; ++path_index) {
-		const char * s = paths[path_index];
-		while (*s != '\0') {
-			dest[dest_index] = *s;
-			dest_index++, s++;
+// runs each part as far as job->level allows
+static void *
+apply_worker(void * data) {
+	ApplyJob * job = data;
+	ArenaCursor cursor = { 0 };
+	char * log = NULL;
+	tMoveLog = &log;
+	for (;;) {
+		int part = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+		if (part >= arrlen(job->parts)) break;
+		uint32_t i = job->parts[part];
+		while (i != APPLY_DONE && job->depth[i] >= job->level) {
+			if (__atomic_load_n(&job->failed, __ATOMIC_RELAXED)) goto done;
+			arrsetlen(log, 0);
+			int error = apply_op(&job->plan[i]);
+			const char * text = Arena_push_string(&gArena, &cursor, log, arrlen(log));
+			apply_publish(job, i, text ? text : "");
+			if (error) {
+				__atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+				goto done;
+			}
+			i = job->after[i];
 		}
-		if (path_index != num_paths-1 && dest[dest_index-1] != '/')
-			dest[dest_index++] = '/';
+		job->parts[part] = i;
 	}
-	dest[dest_index] = '\0';
+done:
+	tMoveLog = NULL;
+	arrfree(log);
+	return NULL;
 }
 
-static void
-make_new_path(const char * dir_name, const char * d_name, char * new_path) {
-	if (strcmp(dir_name, ".") != 0) {
-		const char * to_join [] = {dir_name, d_name};
-		paths_join(new_path, LENGTH(to_join), to_join);
-	} else {
-		strcpy(new_path, d_name);
+// removes the directories that moves left if they are empty now,
+// checking each of them once
+static int
+remove_left_dirs(const MoveOp * plan, int count) {
+	int error = 0;
+	PathSlot * left = NULL;
+	sh_new_arena(left);
+	for (int i=0; i < count; i++) {
+		if (plan[i].kind != MOVE_RENAME) continue;
+		char dir_name [PATH_MAX];
+		if (get_dir_name(dir_name, plan[i].from) == 0 || shgeti(left, dir_name) >= 0) continue;
+		shput(left, dir_name, i);
+		error = remove_empty_recursive(plan[i].from);
+		if (error) break;
 	}
+	shfree(left);
+	return error;
 }
 
+// runs the groups of plan on threads. empty directories are removed
+// afterwards, once for each directory a move left
 static int
-find_recursive(const char * dir_name, char *** file_list, StringBucket ** file_list_buffer) {
-	DIR * directory = opendir(dir_name);
-	struct dirent * entry;
-	if (!directory) {
-		fprintf(stderr, "could not open directory \"%s\"\n", dir_name);
-		return -1;
+apply_parallel(const MoveOp * plan, int count, int threads) {
+	ApplyJob job;
+	memset(&job, 0, sizeof(job));
+	job.plan = plan;
+	job.count = count;
+
+	int error = 0;
+	job.text = calloc(count, sizeof(*job.text));
+	uint8_t * levels = calloc(UINT16_MAX + 1, 1);
+	if (!job.text || !levels || !apply_depths(&job) || !apply_order(&job, 1)) {
+		fprintf(stderr, "out of memory\n");
+		error = -1;
+	} else {
+		pthread_mutex_init(&job.lock, NULL);
+		if (threads > arrlen(job.parts)) threads = arrlen(job.parts);
+		// only the levels that have operations need a round
+		for (int i=0; i < count; i++) levels[job.depth[i]] = 1;
+		for (int level=UINT16_MAX; level >= 0 && !job.failed; level--) {
+			if (!levels[level]) continue;
+			job.level = level;
+			job.next = 0;
+			run_threads(apply_worker, &job, threads);
+		}
+		pthread_mutex_destroy(&job.lock);
+		// after a failure the other threads may have gone further
+		for (int i=job.printed; i < count; i++) {
+			if (job.text[i]) fputs(job.text[i], stdout);
+		}
+		error = job.failed ? -1 : 0;
 	}
+	arrfree(job.parts);
+	free(job.after);
+	free(job.text);
+	free(job.depth);
+	free(levels);
+	if (error) return error;
+	return remove_left_dirs(plan, count);
+}
 
-	int open_type = (arg_mask & ARG_DMODE) ? DT_DIR : DT_REG;
-	while ((entry = readdir(directory)) != NULL) {
-		if (entry->d_type == open_type) {
-			if (entry->d_name[0] != '.' || (arg_mask & ARG_HIDDEN)) {
-				char new_path [PATH_MAX];
-				make_new_path(dir_name, entry->d_name, new_path);
+#if defined(__linux__)
+#define APPLY_RING_ENTRIES 256
+
+enum {
+	DIR_TARGET = 0x1, // a move goes into it
+	DIR_MADE   = 0x2,
+};
+
+// applies a plan through one io_uring. first the directories the moves
+// go to are made, a level at a time, then every part keeps its next
+// operation in flight until all of them are done
+typedef struct ApplyRing {
+	Uring ring;
+	int making_dirs;
+	uint32_t * ready;  // requests that can be submitted, oldest first
+	int ready_next;
+	uint32_t * waiting; // next operations of groups held back by job.level
+	int in_flight;
+	PathSlot * dirs;   // see DIR_TARGET
+	int failed;
+	uint8_t * retried; // per operation: a removal found a directory
+	ApplyJob job;
+	ArenaCursor cursor;
+	char * log;
+} ApplyRing;
 
-				size_t filename_len = strlen(new_path);
-				StringBucket * bucket = &arrlast(*file_list_buffer);
-				if (bucket->length + filename_len + 1 > STRING_BUCKET_CAPACITY) {
-					arrput(*file_list_buffer, StringBucket_create());
-					bucket = &arrlast(*file_list_buffer);
-				}
-				char * new_filename_loc = &bucket->data[bucket->length];
-				strcpy(new_filename_loc, new_path);
-				bucket->length += filename_len + 1;
+static void
+ApplyRing_prepare(ApplyRing * r, uint32_t index, struct io_uring_sqe * sqe) {
+	sqe->fd = AT_FDCWD;
+	if (r->making_dirs) {
+		sqe->opcode = IORING_OP_MKDIRAT;
+		sqe->addr = (unsigned long)r->dirs[index].key;
+		sqe->len = 0777;
+		return;
+	}
+	const MoveOp * op = &r->job.plan[index];
+	sqe->addr = (unsigned long)op->from;
+	if (op->kind == MOVE_REMOVE) {
+		sqe->opcode = IORING_OP_UNLINKAT;
+		sqe->unlink_flags = r->retried[index] ? AT_REMOVEDIR : 0;
+	} else {
+		sqe->opcode = IORING_OP_RENAMEAT;
+		sqe->len = AT_FDCWD;
+		sqe->addr2 = (unsigned long)op->to;
+		sqe->rename_flags = op->kind == MOVE_EXCHANGE ? RENAME_EXCHANGE : RENAME_NOREPLACE;
+	}
+}
 
-				arrput(*file_list, new_filename_loc);
-			}
+static void
+ApplyRing_complete(ApplyRing * r, uint32_t index, int result) {
+	if (r->making_dirs) {
+		struct stat dir_stat;
+		if (result == 0) {
+			r->dirs[index].value |= DIR_MADE;
+		} else if (result != -EEXIST
+		        || ((r->dirs[index].value & DIR_TARGET)
+		         && (stat(r->dirs[index].key, &dir_stat) || !S_ISDIR(dir_stat.st_mode))))
+		{
+			// a file in the way of a parent fails its children with ENOTDIR
+			fprintf(stderr, "failed to create directory '%s'\n", r->dirs[index].key);
+			r->failed = 1;
 		}
-		if (entry->d_type == DT_DIR && (arg_mask & ARG_RECUR)) {
-			if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
-				if (entry->d_name[0] != '.' || (arg_mask & ARG_HIDDEN)) {
-					char new_path [PATH_MAX];
-					make_new_path(dir_name, entry->d_name, new_path);
+		return;
+	}
+	const MoveOp * op = &r->job.plan[index];
+	// remove() takes empty directories as well
+	if (op->kind == MOVE_REMOVE && result == -EISDIR && !r->retried[index]) {
+		r->retried[index] = 1;
+		arrput(r->ready, index);
+		return;
+	}
 
-					int result = find_recursive(new_path, file_list, file_list_buffer);
-					if (result) {
-						closedir(directory);
-						return result;
-					}
-				}
-			}
+	if (op->kind == MOVE_RENAME && result < 0) {
+		result = rename_fallback(op->from, op->to, -result) ? -errno : 0;
+	}
+	arrsetlen(r->log, 0);
+	if (op->kind == MOVE_EXCHANGE && (result == -EINVAL || result == -ENOTSUP)) {
+		do_exchange(op->from, op->to);
+	} else {
+		char a1 [PATH_MAX], a2 [PATH_MAX];
+		get_bash_path(a1, op->from);
+		if (op->kind == MOVE_REMOVE) {
+			rprintf("rm %s\n", a1);
+		} else {
+			get_bash_path(a2, op->to);
+			rprintf(op->kind == MOVE_EXCHANGE ? "mv --exchange %s %s\n" : "mv %s %s\n", a1, a2);
 		}
+		if (result < 0) rprintf(" # FAILED!");
 	}
+	const char * text = Arena_push_string(&gArena, &r->cursor, r->log, arrlen(r->log));
+	apply_publish(&r->job, index, text ? text : "");
 
-	closedir(directory);
-	return 0;
+	uint32_t next = r->job.after[index];
+	if (next != APPLY_DONE) {
+		if (r->job.depth[next] >= r->job.level) {
+			arrput(r->ready, next);
+		} else {
+			arrput(r->waiting, next);
+		}
+	}
 }
 
+// submits what is ready and handles what completes until nothing is left
 static int
-get_dir_name(char * ret_dir_name, const char * path) {
-	char * last_slash = strrchr(path, '/');
-	if (last_slash == NULL)
-		return 0;
-	size_t dir_name_size = last_slash - path;
-	strncpy(ret_dir_name, path, dir_name_size);
-	ret_dir_name[dir_name_size] = '\0';
-	return dir_name_size;
-}
-
-#define rprintf(...) if(!(arg_mask&ARG_QUIET))printf(__VA_ARGS__)
-
-void
-get_bash_path(char * dest, const char * str) {
-	*dest++ = '"';
-	while (*str) {
-		if (*str == '"' || *str == '`' || *str == '\\' || *str == '$')
-			*dest++ = '\\';
-		*dest++ = *str;
-		str++;
+ApplyRing_run(ApplyRing * r) {
+	while (r->ready_next < arrlen(r->ready) || r->in_flight > 0) {
+		while (r->ready_next < arrlen(r->ready) && r->in_flight < (int)r->ring.entries) {
+			struct io_uring_sqe * sqe = Uring_sqe(&r->ring);
+			if (!sqe) break;
+			uint32_t index = r->ready[r->ready_next++];
+			ApplyRing_prepare(r, index, sqe);
+			sqe->user_data = index;
+			r->in_flight++;
+		}
+		if (Uring_submit(&r->ring, 1)) return -1;
+
+		struct io_uring_cqe * cqe;
+		while ((cqe = Uring_cqe(&r->ring)) != NULL) {
+			uint32_t index = cqe->user_data;
+			int result = cqe->res;
+			Uring_cqe_seen(&r->ring);
+			r->in_flight--;
+			ApplyRing_complete(r, index, result);
+		}
 	}
-	*dest++ = '"';
-	*dest = '\0';
+	arrsetlen(r->ready, 0);
+	r->ready_next = 0;
+	return 0;
 }
 
+// makes every directory the moves go to, parents first. prints them
+// like mkdir -p would have been run for each
 static int
-remove_empty_recursive(const char * dir_path) {
-	char dir_name [PATH_MAX];
-	int dir_name_size = get_dir_name(dir_name, dir_path);
-	if (dir_name_size == 0) return 0;
-
-	DIR * dir = opendir(dir_name);
-	struct dirent * entry;
-	if (!dir) {
-		fprintf(stderr, "failed to open %s\n", dir_name);
-		return -1;
+apply_uring_dirs(ApplyRing * r, const MoveOp * plan, int count) {
+	sh_new_arena(r->dirs);
+	shdefault(r->dirs, 0);
+	for (int i=0; i < count; i++) {
+		if (plan[i].kind != MOVE_RENAME) continue;
+		char dir_name [PATH_MAX];
+		int len = get_dir_name(dir_name, plan[i].to);
+		if (len == 0) continue;
+		int at = shgeti(r->dirs, dir_name);
+		if (at >= 0) {
+			r->dirs[at].value |= DIR_TARGET;
+			continue;
+		}
+		shput(r->dirs, dir_name, DIR_TARGET);
+		for (int end=len-1; end > 0; end--) {
+			if (dir_name[end] != '/') continue;
+			dir_name[end] = '\0';
+			if (shgeti(r->dirs, dir_name) >= 0) break;
+			shput(r->dirs, dir_name, 0);
+		}
 	}
 
-	int file_count = 0;
-	while((entry = readdir(dir)) != NULL) {
-		if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
-			file_count++;
+	// a level can only be made once the one above it is there
+	uint32_t ** levels = NULL;
+	for (int d=0; d < shlen(r->dirs); d++) {
+		int depth = 0;
+		for (const char * p = r->dirs[d].key; *p; p++) depth += *p == '/';
+		while (arrlen(levels) <= depth) arrput(levels, NULL);
+		arrput(levels[depth], d);
+	}
+	r->making_dirs = 1;
+	int error = 0;
+	for (int l=0; l < arrlen(levels); l++) {
+		if (!error && !r->failed) {
+			for (int d=0; d < arrlen(levels[l]); d++) arrput(r->ready, levels[l][d]);
+			error = ApplyRing_run(r);
+		}
+		arrfree(levels[l]);
 	}
-	closedir(dir);
+	arrfree(levels);
+	r->making_dirs = 0;
+	if (error || r->failed) return -1;
 
-	if (file_count == 0) {
-		remove(dir_name);
-		char arg [PATH_MAX];
-		get_bash_path(arg, dir_name);
-		rprintf("rm -r %s\n", arg);
-		return remove_empty_recursive(dir_name);
-	} else {
-		return 0;
+	for (int i=0; i < count; i++) {
+		if (plan[i].kind != MOVE_RENAME) continue;
+		char dir_name [PATH_MAX];
+		if (get_dir_name(dir_name, plan[i].to) == 0) continue;
+		int at = shgeti(r->dirs, dir_name);
+		if (r->dirs[at].value == (DIR_TARGET | DIR_MADE)) {
+			char arg [PATH_MAX];
+			get_bash_path(arg, dir_name);
+			rprintf("mkdir -p %s\n", arg);
+			r->dirs[at].value = DIR_TARGET;
+		}
 	}
+	return 0;
 }
 
-sort_function_t
-get_sort_function_from_string(const char * str) {
-	if (strcmp(str, "name") == 0) {
-		return sort_function_name;
-	} else if (strcmp(str, "size") == 0) {
-		return sort_function_size;
-	} else if (strcmp(str, "date") == 0) {
-		return sort_function_mod;
-	} else {
-		fprintf(stderr, "unknown sort order \"%s\".\n", str);
-		return NULL;
+// whether a directory that a move goes to is a path of an operation that
+// runs with or before that move. apply_uring_dirs makes them all first,
+// where the operation would find them in its way or move them off
+static int
+apply_uring_nested(const ApplyJob * job) {
+	const MoveOp * plan = job->plan;
+	PathSlot * paths = NULL;
+	shdefault(paths, -1);
+	// of two operations on a path the one that runs first
+	for (int i=0; i < job->count; i++) {
+		for (int side=0; side < 2; side++) {
+			if (side == 1 && plan[i].kind == MOVE_REMOVE) break;
+			const char * path = side ? plan[i].to : plan[i].from;
+			int other = shget(paths, path);
+			if (other < 0 || job->depth[other] < job->depth[i]) shput(paths, path, i);
+		}
+	}
+	int nested = 0;
+	for (int i=0; i < job->count && !nested; i++) {
+		if (plan[i].kind != MOVE_RENAME) continue;
+		char path [PATH_MAX];
+		strcpy(path, plan[i].to);
+		for (int end=strlen(path)-1; end > 0 && !nested; end--) {
+			if (path[end] != '/') continue;
+			path[end] = '\0';
+			int other = shget(paths, path);
+			nested = other >= 0 && job->depth[other] >= job->depth[i];
+		}
 	}
+	shfree(paths);
+	return nested;
 }
 
-int
-do_move(const char * old_name, const char * new_name) {
-	int same = strcmp(old_name, new_name) == 0;
-	if (same) return 0;
+// returns 1 without doing anything if the kernel lacks the operations,
+// or if the plan makes directories that moves go into
+static int
+apply_uring(const MoveOp * plan, int count) {
+	ApplyRing r;
+	memset(&r, 0, sizeof(r));
+	if (Uring_init(&r.ring, APPLY_RING_ENTRIES)) return 1;
+	if (!Uring_supports(&r.ring, IORING_OP_MKDIRAT)
+	 || !Uring_supports(&r.ring, IORING_OP_RENAMEAT)
+	 || !Uring_supports(&r.ring, IORING_OP_UNLINKAT))
+	{
+		Uring_destroy(&r.ring);
+		return 1;
+	}
 
-	if (new_name[0] == '#') {
-		int error = remove(old_name);
-		char arg [PATH_MAX];
-		get_bash_path(arg, old_name);
-		rprintf("rm %s\n", arg);
-		if (error) rprintf(" # FAILED!");
+	int error = 0;
+	r.job.plan = plan;
+	r.job.count = count;
+	r.job.text = calloc(count, sizeof(*r.job.text));
+	r.retried = calloc(count, 1);
+	if (!r.job.text || !r.retried || !apply_depths(&r.job) || !apply_order(&r.job, 0)) {
+		fprintf(stderr, "out of memory\n");
+		error = -1;
+	} else if (apply_uring_nested(&r.job)) {
+		error = 1;
 	} else {
-		char dir_name [PATH_MAX];
-		int dir_name_size = get_dir_name(dir_name, new_name);
-		if (dir_name_size) {
-			struct stat dir_stat;
-			if (!(stat(dir_name, &dir_stat) == 0 && dir_stat.st_mode & S_IFDIR)) {
-				char * cmd_buffer = malloc(dir_name_size + 12);
-				char arg [PATH_MAX];
-				get_bash_path(arg, dir_name);
-				sprintf(cmd_buffer, "mkdir -p %s", arg);
-				int sys_result = system(cmd_buffer);
-				if (sys_result != 0) {
-					fprintf(stderr, "failed to create directory '%s'\n", dir_name);
-					return -1;
+		error = apply_uring_dirs(&r, plan, count);
+		shfree(r.dirs);
+	}
+	if (!error) {
+		pthread_mutex_init(&r.job.lock, NULL);
+		for (int p=0; p < arrlen(r.job.parts); p++) arrput(r.waiting, r.job.parts[p]);
+		// one depth level at a time like apply_parallel, the kernel runs
+		// the requests in flight on its own threads
+		int max_depth = 0;
+		for (int i=0; i < count; i++) {
+			if (r.job.depth[i] > max_depth) max_depth = r.job.depth[i];
+		}
+		tMoveLog = &r.log;
+		for (int level=max_depth; level >= 0 && !error && arrlen(r.waiting) > 0; level--) {
+			r.job.level = level;
+			int kept = 0;
+			for (int w=0; w < arrlen(r.waiting); w++) {
+				uint32_t index = r.waiting[w];
+				if (r.job.depth[index] >= level) {
+					arrput(r.ready, index);
+				} else {
+					r.waiting[kept++] = index;
 				}
-				rprintf("%s\n", cmd_buffer);
-				free(cmd_buffer);
 			}
+			arrsetlen(r.waiting, kept);
+			if (arrlen(r.ready) > 0) error = ApplyRing_run(&r);
 		}
-		int error = rename(old_name, new_name);
-		char a1 [PATH_MAX], a2 [PATH_MAX];
-		get_bash_path(a1, old_name);
-		get_bash_path(a2, new_name);
-		rprintf("mv %s %s\n", a1, a2);
-		if (error) rprintf(" # FAILED!");
+		tMoveLog = NULL;
+		pthread_mutex_destroy(&r.job.lock);
+		if (error) fprintf(stderr, "io_uring failed while moving files\n");
+	}
+	free(r.job.text);
+	free(r.job.depth);
+	arrfree(r.job.parts);
+	free(r.job.after);
+	free(r.retried);
+	arrfree(r.ready);
+	arrfree(r.waiting);
+	arrfree(r.log);
+	Uring_destroy(&r.ring);
+	if (error) return error;
+	return remove_left_dirs(plan, count);
+}
+#endif
 
-		int result = remove_empty_recursive(old_name);
-		if (result) return result;
+// applies the operations of plan, a level at a time like apply_parallel
+// and in order within a level. unless --jobs is 1, big plans
+// go through io_uring, or group by group on --jobs threads when that is
+// not available
+static int
+apply_plan(const MoveOp * plan, int count) {
+	int threads = job_count();
+	if (threads > 1 && count >= APPLY_PARALLEL_THRESHOLD) {
+#if defined(__linux__)
+		int result = apply_uring(plan, count);
+		if (result <= 0) return result;
+#endif
+		return apply_parallel(plan, count, threads);
 	}
-	return 0;
+	// the same levels as apply_parallel, the listing need not have the
+	// deeper paths first
+	ApplyJob job;
+	memset(&job, 0, sizeof(job));
+	job.plan = plan;
+	job.count = count;
+	if (!apply_depths(&job)) {
+		fprintf(stderr, "out of memory\n");
+		return -1;
+	}
+	int max_depth = 0;
+	for (int i=0; i < count; i++) {
+		if (job.depth[i] > max_depth) max_depth = job.depth[i];
+	}
+	int error = 0;
+	for (int level=max_depth; level >= 0 && !error; level--) {
+		for (int i=0; i < count && !error; i++) {
+			if (job.depth[i] != level) continue;
+			error = apply_op(&plan[i]);
+			if (!error && plan[i].kind == MOVE_RENAME) error = remove_empty_recursive(plan[i].from);
+		}
+	}
+	free(job.depth);
+	return error;
 }
 
 int
@@ -383,8 +3654,8 @@ main(int argc, char ** args) {
 	char * dir_name = NULL;
 
 	// defaults
-	sort_function_child = sort_function_name;
-	sort_function_type_next = sort_function_name;
+	gSortOrder[0] = sort_function_name;
+	gSortOrderCount = 1;
 
 	// parse arguments
 	for (int i=1; i < argc; ++i) {
@@ -392,20 +3663,30 @@ main(int argc, char ** args) {
 			if (args[i][1] == '-') {
 				if (strcmp(&args[i][2], "order") == 0) {
 					i++;
-					if (strncmp(args[i], "type", 4) == 0) {
-						sort_function_child = sort_function_type;
-						if (args[i][4] == ':') {
-							sort_function_type_next = get_sort_function_from_string(&args[i][5]);
-							if (sort_function_type_next == NULL) {
-								return 1;
-							}
-						}
-					} else {
-						sort_function_child = get_sort_function_from_string(args[i]);
-						if (sort_function_child == NULL) {
-							return 1;
-						}
+					if (i >= argc) {
+						fprintf(stderr, "--order expects a list of keys\n");
+						return 1;
+					}
+					if (parse_sort_order(args[i])) {
+						return 1;
+					}
+				} else if (strcmp(&args[i][2], "jobs") == 0) {
+					i++;
+					if (i >= argc || (gJobs = atoi(args[i])) <= 0) {
+						fprintf(stderr, "--jobs expects a positive number\n");
+						return 1;
+					}
+				} else if (strcmp(&args[i][2], "index") == 0) {
+					i++;
+					if (i >= argc) {
+						fprintf(stderr, "--index expects a file\n");
+						return 1;
 					}
+					gIndexPath = args[i];
+				} else if (strcmp(&args[i][2], "ignore-case") == 0) {
+					gFoldCase = 1;
+				} else if (strcmp(&args[i][2], "collate") == 0) {
+					gCollate = 1;
 				} else if (strcmp(&args[i][2], "reverse") == 0) {
 					gSortDirection = -1;
 				} else if (strcmp(&args[i][2], "help") == 0) {
@@ -447,19 +3728,34 @@ main(int argc, char ** args) {
 		fputs("try \"blkmv --help\" for additional information.\n", stderr);
 		return 1;
 	}
+	sort_select_prime();
+	compare_natural_select();
+	if (gCollate && !setlocale(LC_COLLATE, "")) {
+		fprintf(stderr, "could not set the locale, collating by bytes\n");
+	}
 
 	// create a temporary file so it can be opened in the editor
-	// the program makes sure to create a unique file
-	// in case there are two instances running at once
-	char filename_buf [64];
-	int mid_num = 0;
-	do {
-		snprintf(filename_buf, sizeof(filename_buf), "%s%i%s", FILEPATH_PREFIX, mid_num++, FILEPATH_POSTFIX);
-	} while(access(filename_buf, F_OK) == 0);
+	char filename_buf [PATH_MAX];
+	int fd = create_temp_file(filename_buf, sizeof(filename_buf));
+	if (fd < 0) {
+		fprintf(stderr, "failed to create temporary file.\n");
+		return -1;
+	}
+
+	// the index path has to survive the chdir below
+	char index_path_full [PATH_MAX];
+	if (gIndexPath && gIndexPath[0] != '/') {
+		char cwd [PATH_MAX];
+		if (getcwd(cwd, sizeof(cwd))
+		 && snprintf(index_path_full, sizeof(index_path_full), "%s/%s", cwd, gIndexPath) < (int)sizeof(index_path_full))
+		{
+			gIndexPath = index_path_full;
+		}
+	}
 
 	// create list of files
+	char dir_name_full [PATH_MAX];
 	{
-		char dir_name_full [PATH_MAX];
 		if (!(arg_mask & ARG_FULL)) {
 			if (chdir(dir_name)) {
 				fprintf(stderr, "failed to change working directory\n");
@@ -472,55 +3768,74 @@ main(int argc, char ** args) {
 			}
 		}
 	}
-	char        ** og_name_list = NULL;
-	StringBucket * og_name_buffer = NULL;
-	arrput(og_name_buffer, StringBucket_create());
-	if (find_recursive(dir_name, &og_name_list, &og_name_buffer)) {
+	if (Arena_init(&gArena)) {
+		fprintf(stderr, "failed to reserve memory\n");
+		close(fd);
+		remove(filename_buf);
+		return -1;
+	}
+	// the names are written to the file in large blocks. without an
+	// order they go there while the scan is merged
+	LineWriter writer;
+	if (LineWriter_init(&writer, fd)) {
+		fprintf(stderr, "out of memory\n");
+		close(fd);
+		remove(filename_buf);
+		return -1;
+	}
+	int streaming = gSortOrderCount == 0;
+	if (find_recursive(dir_name, &gEntries, streaming ? &writer : NULL)) {
+		LineWriter_finish(&writer);
+		close(fd);
+		remove(filename_buf);
 		return -1;
 	}
 
-	int count_files = arrlen(og_name_list);
+	int count_files = arrlen(gEntries.name);
 	if (count_files == 0) {
+		LineWriter_finish(&writer);
+		close(fd);
+		remove(filename_buf);
 		fprintf(stderr, "directory is empty.\n");
 		return 1;
 	}
 
-	// create sorted list
-	FileInfo * sorted_list = malloc(count_files * sizeof(*sorted_list));
-	for (int i=0; i < count_files; ++i) {
-		sort_function_t temp_sort_function;
-		if (sort_function_child == sort_function_type) {
-			temp_sort_function = sort_function_type_next;
-		} else {
-			temp_sort_function = sort_function_child;
-		}
-
-		FileInfo new;
-		new.name = og_name_list[i];
-		new.nslashes = count_slashes(new.name);
-		if (temp_sort_function == sort_function_size || temp_sort_function == sort_function_mod) {
-			struct stat new_stat;
-			stat(new.name, &new_stat);
-			if (temp_sort_function == sort_function_size) {
-				new.size = new_stat.st_size;
-			} else if (temp_sort_function == sort_function_mod) {
-				new.mod_time = new_stat.st_mtime;
-			}
-		}
-		sorted_list[i] = new;
+	// sort
+	unsigned int stat_mask = 0;
+	if (gSortKeySize >= 0) stat_mask |= STATX_SIZE;
+	if (gSortKeyDate >= 0) stat_mask |= STATX_MTIME;
+	if (gIndexPath) {
+		if (stat_mask) index_stat_list(stat_mask);
+		index_write(gIndexPath);
+	} else if (stat_mask) {
+		stat_list(NULL, count_files, stat_mask);
 	}
-	qsort(sorted_list, count_files, sizeof(*sorted_list), sort_function_prime);
 
-	// print all the names to the file
-	FILE * file = fopen(filename_buf, "w");
-	for (int i=0; i < count_files; ++i) {
-		fprintf(file, "%s\n", sorted_list[i].name);
+	// without an order the names are already written, in entry order
+	uint32_t * sorted_list = NULL;
+	if (!streaming) {
+		sorted_list = malloc(count_files * sizeof(*sorted_list));
+		for (int i=0; i < count_files; ++i) {
+			sorted_list[i] = i;
+		}
+		entry_rank_dirs(&gEntries);
+		sort_entries(sorted_list, count_files);
+
+		for (int i=0; i < count_files; ++i) {
+			LineWriter_put_entry(&writer, sorted_list[i]);
+		}
+	}
+	int write_error = LineWriter_finish(&writer);
+	close(fd);
+	if (write_error) {
+		fprintf(stderr, "failed to write temporary file.\n");
+		remove(filename_buf);
+		return -1;
 	}
-	fclose(file);
 
 	// open file in editor
-	char command [128];
-	snprintf(command, sizeof(command), "%s %s", editor, filename_buf);
+	char command [PATH_MAX + 128];
+	snprintf(command, sizeof(command), "%s '%s'", editor, filename_buf);
 	int cmd_result = system(command);
 	if (cmd_result) {
 		fprintf(stderr, "failed to execute \"%s\"\n", command);
@@ -528,58 +3843,108 @@ main(int argc, char ** args) {
 		return -1;
 	}
 
-	// load edited file into buffer
-	file = fopen(filename_buf, "r");
-	fseek(file, 0l, SEEK_END);
-	size_t filesize = ftell(file);
-	fseek(file, 0l, SEEK_SET);
-	char * buffer = malloc(filesize+1);
-	if (!fread(buffer, filesize, 1, file)) {
-		fclose(file);
+	// map the edited file, the editor may have replaced it
+	int edit_fd = open(filename_buf, O_RDONLY);
+	struct stat edit_stat;
+	if (edit_fd < 0 || fstat(edit_fd, &edit_stat)) {
 		fprintf(stderr, "failed to read temporary file.\n");
 		remove(filename_buf);
 		return -1;
 	}
-	fclose(file);
+	size_t filesize = edit_stat.st_size;
+	const char * buffer = "";
+	if (filesize > 0) {
+		buffer = mmap(NULL, filesize, PROT_READ, MAP_PRIVATE, edit_fd, 0);
+		if (buffer == MAP_FAILED) {
+			close(edit_fd);
+			fprintf(stderr, "failed to read temporary file.\n");
+			remove(filename_buf);
+			return -1;
+		}
+		madvise((void *)buffer, filesize, MADV_SEQUENTIAL);
+	}
+	close(edit_fd);
 	remove(filename_buf); // delete temporary file
-	buffer[filesize] = '\0';
 
-	// get new names
-	char ** new_names = malloc( count_files * sizeof(*new_names) );
-	{
-		int count_new = 0;
-		char * p = buffer;
-		new_names[count_new] = p;
-		while (*p != '\0') {
-			if (*p == '\n') {
-				*p = '\0'; // replace newline with null
-				count_new++;
-				if (count_new < count_files) {
-					new_names[count_new] = p+1;
-				}
-			}
-			p++;
-		}
+	// get new names, line i is new_names[i] up to new_names[i+1]-1
+	const char ** new_names = Arena_alloc(&gArena, &gEntries.cursor, (count_files + 1) * sizeof(*new_names));
+	if (!new_names) {
+		fprintf(stderr, "out of memory\n");
+		return -1;
+	}
+	if (split_edit_buffer(buffer, filesize, count_files, new_names)) {
+		return -1;
+	}
 
-		if (count_new != count_files) {
-			fprintf(stderr, "line count was changed, no action can be taken\n");
+	// keep the changed lines, both paths as strings of their own
+	const char ** move_from = NULL;
+	const char ** move_to = NULL;
+	int * move_line = NULL;
+	int errors = 0;
+	for (int i=0; i < count_files; i++) {
+		char old_name [PATH_MAX];
+		size_t len = new_names[i+1] - 1 - new_names[i];
+		// checked to be shorter by split_edit_buffer, except for deletions
+		if (len >= PATH_MAX) len = PATH_MAX - 1;
+		uint32_t entry = sorted_list ? sorted_list[i] : (uint32_t)i;
+		entry_path(entry, old_name);
+		if (strlen(old_name) == len && memcmp(old_name, new_names[i], len) == 0) continue;
+		// likely left by the editor, names that already end so are fine
+		char last = new_names[i][len-1];
+		if (new_names[i][0] != '#' && (last == ' ' || last == '\t' || last == '\r')) {
+			edit_error(&errors, i + 1, "ends in whitespace");
+			continue;
+		}
+		// both sides written one way, so the plan compares paths, not spellings
+		char new_name [PATH_MAX];
+		memcpy(new_name, new_names[i], len);
+		new_name[len] = '\0';
+		if (new_name[0] != '#') len = normalize_path(new_name);
+		size_t old_len = normalize_path(old_name);
+		if (old_len == len && memcmp(old_name, new_name, len) == 0) continue;
+		const char * from = Arena_push_string(&gArena, &gEntries.cursor, old_name, old_len);
+		const char * to = Arena_push_string(&gArena, &gEntries.cursor, new_name, len);
+		if (!from || !to) {
+			fprintf(stderr, "out of memory\n");
 			return -1;
 		}
+		arrput(move_from, from);
+		arrput(move_to, to);
+		arrput(move_line, i + 1);
 	}
-
-	for (int i=0; i < count_files; i++) {
-		int error = do_move(sorted_list[i].name, new_names[i]);
-		if (error) return error;
+	if (filesize > 0) munmap((void *)buffer, filesize);
+	if (errors) {
+		if (errors > EDIT_ERRORS_MAX) fprintf(stderr, "and %d more\n", errors - EDIT_ERRORS_MAX);
+		fprintf(stderr, "no action can be taken\n");
+		return -1;
 	}
 
-	for (int i=arrlen(og_name_buffer)-1; i >= 0; --i) {
-		free(og_name_buffer[i].data);
+	// nothing is touched unless every move is safe
+	MoveOp * plan = NULL;
+	if (arrlen(move_from) > 0) {
+		PathSlot * sources = move_sources(move_from, arrlen(move_from));
+		if (move_plan_check(move_from, move_to, move_line, arrlen(move_from), sources)) {
+			fprintf(stderr, "no action can be taken\n");
+			return -1;
+		}
+		plan = move_plan_build(move_from, move_to, arrlen(move_from), sources);
+		shfree(sources);
+		if (!plan) {
+			fprintf(stderr, "out of memory\n");
+			return -1;
+		}
 	}
-	free(new_names);
-	free(buffer);
+	int error = apply_plan(plan, arrlen(plan));
+	if (error) return error;
+
+	arrfree(plan);
+	arrfree(move_from);
+	arrfree(move_to);
+	arrfree(move_line);
+	shfree(gDirsKnown);
 	free(sorted_list);
-	arrfree(og_name_list);
-	arrfree(og_name_buffer);
+	entry_table_free(&gEntries);
+	Arena_free(&gArena);
 
 	return 0;
 }